@@ -0,0 +1,318 @@
+// Command-level microbenchmarks for the native engine build.
+//
+// Every benchmark runs a request made of a setup part and the command under
+// test, and reports the cost of the whole request as well as the net cost
+// of the command (minus the setup on its own). Only the dumpStack cases
+// include formatting the output, the rest stop after Engine::run so the
+// stack left behind doesn't skew the net numbers. The request shapes follow
+// what checker/checker.py sends: immediates in place or pushed beforehand,
+// decimal/hex/paired integers and stack-drawn arguments.
+//
+// GQR accesses are counted too. The emulation makes them free here, but
+// each mtspr/mfspr serializes on the console, so fewer of them is what
+// shows up as cycles there (see profile.h for timing on Dolphin).
+
+#include "engine.h"
+#include "host.h"
+#include "quant.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+extern "C" void __libc_free(void *p);
+
+static uint64_t g_alloc_count = 0;
+static uint64_t g_alloc_bytes = 0;
+
+// Interpose the allocator to count what the engine does per request.
+extern "C" void *malloc(size_t size)
+{
+	++g_alloc_count;
+	g_alloc_bytes += size;
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+	++g_alloc_count;
+	g_alloc_bytes += count * size;
+	return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *p, size_t size)
+{
+	++g_alloc_count;
+	g_alloc_bytes += size;
+	return __libc_realloc(p, size);
+}
+
+extern "C" void free(void *p)
+{
+	__libc_free(p);
+}
+
+// Answers every query like a frontend would for a fresh anonymous user.
+class BenchBackend : public HostMessageBackend
+{
+public:
+	void hang() override
+	{
+		fprintf(stderr, "bench: engine hung\n");
+		abort();
+	}
+
+protected:
+	void onMessage(uint32_t ident, uint32_t len, const void *data) override
+	{
+		static const uint8_t zeros[0x2c] = {};
+		if (ident == makeIdent("GTNQ"))
+			reply(makeIdent("GTNA"), 8, zeros);
+		else if (ident == makeIdent("OTIQ"))
+			reply(makeIdent("OTIA"), 0x2c, zeros);
+		else if (ident == makeIdent("OTAQ"))
+			reply(makeIdent("OTAA"), 4, zeros);
+		else if (ident == makeIdent("OTGQ"))
+			reply(makeIdent("OTGA"), 0xc, zeros);
+	}
+};
+
+struct BenchCase
+{
+	const char *name;
+	const char *setup;
+	const char *command;
+	bool dump = false;
+};
+
+// Paired immediates: scale byte followed by big-endian int16 values.
+#define P_1234 "pAATS"
+#define P_3_4 "pAAADAAQ="
+#define P_1_TO_32 "pAAABAAIAAwAEAAUABgAHAAgACQAKAAsADAANAA4ADwAQABEAEgATABQAFQAWABcAGAAZABoAGwAcAB0AHgAfACA="
+#define P_POLY "pAAACAAEAAgAD"
+// 10 weights in [-2;2[, 8-bit signed with 6 bits shift
+#define W_10 "ILBAMOBgEMAIcA=="
+
+static const BenchCase s_cases[] = {
+	// havoc int/float
+	{ "int/int",     "", "int:i1234567" },
+	{ "int/hex",     "", "int:i0x12d687" },
+	{ "int/float",   "", "int:f-1234.5" },
+	{ "int/paired",  "", "int:" P_1234 },
+	{ "int/stack",   "float:f1234.5", "int" },
+	{ "float/int",   "", "float:i-4321" },
+	{ "float/float", "", "float:f12345.0078125" },
+	{ "float/stack", "int:i4321", "float:s" },
+
+	// havoc dup/rpt/del/drop/stack
+	{ "dup/int",     "", "dup:i-77" },
+	{ "dup/stack",   "float:f3.5", "dup" },
+	{ "rpt/int",     "", "rpt:i31:i-77" },
+	{ "rpt/stack",   "int:i5 int:i31", "rpt" },
+	{ "del/stack",   "int:i1 int:i2 int:i3", "del" },
+	{ "drop/int",    "rpt:i32:f1.5", "drop:i16" },
+	{ "stack/float", "", "stack:f-2.25" },
+
+	// havoc addi/addf/muli/mulf
+	{ "addi/int",    "", "addi:i123456:i-654321" },
+	{ "addi/stack",  "int:i-654321 int:i123456", "addi" },
+	{ "addi/mixed",  "int:i-654321", "addi:i123456" },
+	{ "addi/paired", "", "addi:" P_3_4 },
+	{ "addf/float",  "", "addf:f1234.5:f-0.0078125" },
+	{ "addf/stack",  "float:f-0.0078125 float:f1234.5", "addf" },
+	{ "muli/int",    "", "muli:i1234:i-4321" },
+	{ "mulf/float",  "", "mulf:f12.5:f-3.25" },
+	{ "mulf/stack",  "float:f-3.25 float:f12.5", "mulf" },
+
+	// havoc poly/weight
+	{ "poly/quadratic",   "", "poly:i3:f2.25:i-7:i3:i12" },
+	{ "poly/stack",       "int:i12 int:i3 int:i-7 float:f2.25 int:i3", "poly" },
+	{ "poly/paired",      "", "poly:i3:f2.25:" P_POLY },
+	{ "poly/paired32",    "", "poly:i32:f0.5:" P_1_TO_32 },
+	{ "weight/10",        "float:f1 float:f2 float:f3 float:f4 float:f5 float:f6 float:f7 float:f8 float:f9 float:f10", "weight:" W_10 },
+
+	// Vectors of 32 elements
+	{ "vec/paired32",  "", "vec:i32:" P_1_TO_32 },
+	{ "vaddf/32",      "vec:i32:" P_1_TO_32 " dup", "vaddf" },
+	{ "vscale/32",     "vec:i32:" P_1_TO_32, "vscale:f0.5" },
+	{ "vsumf/32",      "vec:i32:" P_1_TO_32, "vsumf" },
+	{ "vdotf/32",      "vec:i32:" P_1_TO_32 " dup", "vdotf" },
+
+	// Reductions over 100 stack entries
+	{ "sumi/100",  "rpt:i100:i3", "sumi:i100" },
+	{ "sumf/100",  "rpt:i100:f1.5", "sumf:i100" },
+	{ "maxf/100",  "rpt:i100:f1.5", "maxf:i100" },
+	{ "scanf/100", "rpt:i100:f1.5", "scanf:i100" },
+
+	// Folded before the request runs, see engine_opt.cpp
+	{ "fold/chain",   "", "int:i3 int:i4 addi muli:i2" },
+	{ "fold/floats",  "", "float:f1.5 dup mulf addf:f-0.25 dup addf" },
+	{ "fold/sumi",    "", "rpt:i16:i3 sumi:i16" },
+	{ "dupdel/stack", "int:i1", "dup del" },
+
+	// havoc inspect
+	{ "inspect/int",      "", "inspect:i1:i1:i5:f2.5" },
+	{ "inspect/stack15",  "rpt:i15:f1.5 rpt:i15:i-3", "inspect:i15:i15" },
+	{ "inspect/paired32", "", "inspect:i16:i16:" P_1_TO_32 },
+
+	// Host queries, answered right away
+	{ "user/int",    "", "user:i1:i2:i3:i4" },
+	{ "getn/int",    "user:i1:i2:i3:i4", "getn:i5" },
+	{ "setn/int",    "user:i1:i2:i3:i4", "setn:i5:i-6" },
+	{ "lockn/int",   "user:i1:i2:i3:i4", "lockn:i5" },
+	{ "otp_sync",    "", "otp_sync:i1:i2" },
+
+	{ "print",       "", "print:hello world" },
+	{ "help",        "", "help" },
+
+	// Output formatting of a full stack
+	{ "dumpStack/int",   "rpt:i255:i-1234567", "", true },
+	{ "dumpStack/float", "rpt:i255:f-1234.5678", "", true },
+};
+
+struct BenchResult
+{
+	uint64_t iterations;
+	double ns_per_op;
+	double allocs_per_op;
+	double bytes_per_op;
+	double sprs_per_op;
+};
+
+static void runOnce(const char *request, bool dump)
+{
+	if (dump)
+	{
+		free(processRequest(request));
+		return;
+	}
+
+	Engine e;
+	e.run(request);
+}
+
+static BenchResult runRequest(const char *request, bool dump, double min_time)
+{
+	using clock = std::chrono::steady_clock;
+
+	// Warm up
+	for (int i = 0; i < 16; ++i)
+		runOnce(request, dump);
+
+	BenchResult best = {};
+	uint64_t iterations = 16;
+	for (;;)
+	{
+		uint64_t allocs_before = g_alloc_count;
+		uint64_t bytes_before = g_alloc_bytes;
+		uint64_t sprs_before = quant_soft_spr_count();
+		auto start = clock::now();
+		for (uint64_t i = 0; i < iterations; ++i)
+			runOnce(request, dump);
+		double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+		best.iterations = iterations;
+		best.ns_per_op = elapsed * 1e9 / iterations;
+		best.allocs_per_op = (double)(g_alloc_count - allocs_before) / iterations;
+		best.bytes_per_op = (double)(g_alloc_bytes - bytes_before) / iterations;
+		best.sprs_per_op = (double)(quant_soft_spr_count() - sprs_before) / iterations;
+		if (elapsed >= min_time)
+			break;
+
+		// Aim a bit past the minimum time
+		double scale = elapsed > 0 ? (min_time * 1.2 / elapsed) : 100;
+		if (scale > 100)
+			scale = 100;
+		iterations = (uint64_t)(iterations * scale) + 1;
+	}
+	return best;
+}
+
+static void usage(const char *self)
+{
+	fprintf(stderr, "usage: %s [--json <path>] [--filter <substring>] [--min-time <seconds>]\n", self);
+}
+
+int main(int argc, char **argv)
+{
+	const char *json_path = nullptr;
+	const char *filter = nullptr;
+	double min_time = 0.2;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--json") && i + 1 < argc)
+			json_path = argv[++i];
+		else if (!strcmp(argv[i], "--filter") && i + 1 < argc)
+			filter = argv[++i];
+		else if (!strcmp(argv[i], "--min-time") && i + 1 < argc)
+			min_time = atof(argv[++i]);
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	BenchBackend backend;
+	hostSetBackend(&backend);
+
+	FILE *json = nullptr;
+	if (json_path)
+	{
+		json = fopen(json_path, "w");
+		if (!json)
+		{
+			perror(json_path);
+			return 1;
+		}
+		fprintf(json, "{\n\t\"unit\": \"ns/op\",\n\t\"benchmarks\": [");
+	}
+
+	printf("%-20s %12s %12s %10s %10s %10s\n", "benchmark", "ns/op", "net ns/op", "allocs/op", "bytes/op", "sprs/op");
+
+	bool first = true;
+	for (const BenchCase &bc : s_cases)
+	{
+		if (filter && !strstr(bc.name, filter))
+			continue;
+
+		char request[1024];
+		snprintf(request, sizeof(request), "%s%s%s", bc.setup, bc.setup[0] && bc.command[0] ? " " : "", bc.command);
+
+		// For dumps, the setup is what we want to measure.
+		BenchResult full = runRequest(request, bc.dump, min_time);
+		BenchResult setup = runRequest(bc.setup, false, min_time);
+		double net_ns = full.ns_per_op - setup.ns_per_op;
+		double net_allocs = full.allocs_per_op - setup.allocs_per_op;
+
+		printf("%-20s %12.1f %12.1f %10.2f %10.1f %10.1f\n",
+			bc.name, full.ns_per_op, net_ns, full.allocs_per_op, full.bytes_per_op, full.sprs_per_op);
+
+		if (json)
+		{
+			fprintf(json, "%s\n\t\t{\"name\": \"%s\", \"request\": \"%s\", \"iterations\": %llu, "
+				"\"ns_per_op\": %.1f, \"net_ns_per_op\": %.1f, "
+				"\"allocs_per_op\": %.2f, \"net_allocs_per_op\": %.2f, \"bytes_per_op\": %.1f, "
+				"\"sprs_per_op\": %.1f, \"net_sprs_per_op\": %.1f}",
+				first ? "" : ",",
+				bc.name, request, (unsigned long long)full.iterations,
+				full.ns_per_op, net_ns,
+				full.allocs_per_op, net_allocs, full.bytes_per_op,
+				full.sprs_per_op, full.sprs_per_op - setup.sprs_per_op);
+		}
+		first = false;
+	}
+
+	if (json)
+	{
+		fprintf(json, "\n\t]\n}\n");
+		fclose(json);
+	}
+
+	hostSetBackend(nullptr);
+	return 0;
+}
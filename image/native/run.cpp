@@ -0,0 +1,71 @@
+// Runs requests through the native engine build, one per line on stdin, and
+// prints each response on a line of its own. Tests compare the frontend
+// against this (service/test_validator.py).
+//
+// Queries get the answers a fresh anonymous user would get. A request that
+// waits for something we don't answer, or hangs otherwise, prints "hang".
+
+#include "engine.h"
+#include "host.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+struct RunHang
+{
+};
+
+class RunBackend : public HostMessageBackend
+{
+public:
+	void hang() override
+	{
+		throw RunHang();
+	}
+
+protected:
+	void onMessage(uint32_t ident, uint32_t len, const void *data) override
+	{
+		static const uint8_t zeros[0x2c] = {};
+		if (ident == makeIdent("GTNQ"))
+			reply(makeIdent("GTNA"), 8, zeros);
+		else if (ident == makeIdent("OTIQ"))
+			reply(makeIdent("OTIA"), 0x2c, zeros);
+		else if (ident == makeIdent("OTAQ"))
+			reply(makeIdent("OTAA"), 4, zeros);
+		else if (ident == makeIdent("OTGQ"))
+			reply(makeIdent("OTGA"), 0xc, zeros);
+	}
+};
+
+int main(int argc, char **argv)
+{
+	RunBackend backend;
+	hostSetBackend(&backend);
+
+	char *line = nullptr;
+	size_t capacity = 0;
+	ssize_t len;
+	while ((len = getline(&line, &capacity, stdin)) >= 0)
+	{
+		if (len && line[len - 1] == '\n')
+			line[len - 1] = '\0';
+
+		backend.reset();
+		try
+		{
+			char *response = processRequest(line);
+			printf("%s\n", response);
+			free(response);
+		}
+		catch (const RunHang &)
+		{
+			printf("hang\n");
+		}
+		fflush(stdout);
+	}
+
+	free(line);
+	return 0;
+}
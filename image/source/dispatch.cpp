@@ -0,0 +1,380 @@
+#if OC_MULTI_REQUEST
+
+#include "dispatch.h"
+#include "engine.h"
+#include "host.h"
+#include "quant.h"
+#include "util.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#if OC_PROFILE
+// The counters in profile.cpp are per request, overlapping requests would
+// mix them up.
+#error "OC_PROFILE can't be combined with OC_MULTI_REQUEST"
+#endif
+
+// Threads are cooperative: a request runs until it waits for a reply, the
+// dispatcher only runs when every request is waiting or idle. On the console
+// this is libogc's priority scheduler, natively only the thread holding the
+// turn runs so the engine can be exercised with several requests.
+#if OC_HOST_NATIVE
+#include <pthread.h>
+
+typedef pthread_t DispatchThread;
+typedef pthread_cond_t DispatchQueue;
+
+// Ticket lock, so a thread giving up the CPU can't just take it back before
+// the others get their turn.
+static pthread_mutex_t s_turn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_turn_changed = PTHREAD_COND_INITIALIZER;
+static uint64_t s_turn_next;
+static uint64_t s_turn_serving;
+static HostBackend *s_backend;
+
+// These expect s_turn_lock to be held.
+static void dispatchTakeTurn()
+{
+	uint64_t ticket = s_turn_next++;
+	while (ticket != s_turn_serving)
+	{
+		pthread_cond_wait(&s_turn_changed, &s_turn_lock);
+	}
+}
+
+static void dispatchGiveTurn()
+{
+	++s_turn_serving;
+	pthread_cond_broadcast(&s_turn_changed);
+}
+
+static void dispatchBegin()
+{
+	pthread_mutex_lock(&s_turn_lock);
+	dispatchTakeTurn();
+	pthread_mutex_unlock(&s_turn_lock);
+}
+
+static void dispatchInitQueue(DispatchQueue *queue)
+{
+	pthread_cond_init(queue, nullptr);
+}
+
+static void dispatchSleep(DispatchQueue *queue)
+{
+	pthread_mutex_lock(&s_turn_lock);
+	dispatchGiveTurn();
+	pthread_cond_wait(queue, &s_turn_lock);
+	dispatchTakeTurn();
+	pthread_mutex_unlock(&s_turn_lock);
+}
+
+static void dispatchSignal(DispatchQueue *queue)
+{
+	pthread_mutex_lock(&s_turn_lock);
+	pthread_cond_signal(queue);
+	pthread_mutex_unlock(&s_turn_lock);
+}
+
+static void dispatchYield()
+{
+	pthread_mutex_lock(&s_turn_lock);
+	dispatchGiveTurn();
+	dispatchTakeTurn();
+	pthread_mutex_unlock(&s_turn_lock);
+}
+#else
+#include <ogc/lwp.h>
+#include <ogc/mutex.h>
+
+typedef lwp_t DispatchThread;
+typedef lwpq_t DispatchQueue;
+
+// Higher numbers run first. Requests preempt the dispatcher as soon as it
+// wakes them up.
+constexpr uint32_t kDispatchPriority = 64;
+constexpr uint32_t kRequestPriority = 65;
+
+// Engine lives on the stack, with room to spare for the commands.
+constexpr uint32_t kRequestStackSize = 0x10000;
+
+static uint8_t s_request_stacks[kDispatchMaxRequests][kRequestStackSize] __attribute__((aligned(32)));
+static mutex_t s_write_lock;
+
+static void dispatchInitQueue(DispatchQueue *queue)
+{
+	LWP_InitQueue(queue);
+}
+
+static void dispatchSleep(DispatchQueue *queue)
+{
+	LWP_ThreadSleep(*queue);
+}
+
+static void dispatchSignal(DispatchQueue *queue)
+{
+	LWP_ThreadSignal(*queue);
+}
+
+static void dispatchYield()
+{
+	LWP_YieldThread();
+}
+#endif
+
+// Replies that arrived before the request asked for them. The host sends one
+// reply per query and the request waits for each, so this only fills up if
+// the host misbehaves.
+constexpr uint32_t kRequestMaxReplies = 8;
+
+struct DispatchReply
+{
+	uint32_t ident;
+	uint32_t len;
+	void *data;
+};
+
+struct RequestSlot
+{
+	DispatchThread thread;
+	DispatchQueue wake;
+
+	// Set while a request is assigned, until its REQA is out.
+	bool busy;
+	// Set while sleeping in hostReadReply().
+	bool waiting;
+	HostMsgContext msg;
+	char *request_text;
+
+	DispatchReply replies[kRequestMaxReplies];
+	uint32_t reply_first;
+	uint32_t reply_count;
+};
+
+static RequestSlot s_slots[kDispatchMaxRequests];
+// Header used by the dispatcher itself, for VERA and busy replies.
+static HostMsgContext s_dispatch_msg;
+
+static RequestSlot *currentSlot()
+{
+#if OC_HOST_NATIVE
+	DispatchThread self = pthread_self();
+	for (RequestSlot &slot : s_slots)
+	{
+		if (pthread_equal(slot.thread, self))
+			return &slot;
+	}
+#else
+	DispatchThread self = LWP_GetSelf();
+	for (RequestSlot &slot : s_slots)
+	{
+		if (slot.thread == self)
+			return &slot;
+	}
+#endif
+	return nullptr;
+}
+
+HostMsgContext *hostMsg()
+{
+	RequestSlot *slot = currentSlot();
+	return slot ? &slot->msg : &s_dispatch_msg;
+}
+
+void hostReadReply(uint32_t *ident, uint32_t *len, void **data)
+{
+	RequestSlot *slot = currentSlot();
+	if (!slot)
+	{
+		OC_ERR("reply read outside of a request%s", "");
+	}
+
+	while (!slot->reply_count)
+	{
+		// GQR2 belongs to the request, the others change it and its shadow
+		// while we sleep.
+		uint32_t gqr = quant_get();
+		slot->waiting = true;
+		dispatchSleep(&slot->wake);
+		slot->waiting = false;
+		quant_load(gqr);
+	}
+
+	const DispatchReply &reply = slot->replies[slot->reply_first];
+	*ident = reply.ident;
+	*len = reply.len;
+	*data = reply.data;
+	slot->reply_first = (slot->reply_first + 1) % kRequestMaxReplies;
+	--slot->reply_count;
+}
+
+#if OC_HOST_NATIVE
+// Only the thread holding the turn writes, and nobody sleeps while writing a
+// message.
+void hostLockWrite()
+{
+}
+
+void hostUnlockWrite()
+{
+}
+#else
+void hostLockWrite()
+{
+	LWP_MutexLock(s_write_lock);
+}
+
+void hostUnlockWrite()
+{
+	LWP_MutexUnlock(s_write_lock);
+}
+#endif
+
+static void *requestThread(void *arg)
+{
+	RequestSlot *slot = (RequestSlot *)arg;
+#if OC_HOST_NATIVE
+	hostSetBackend(s_backend);
+	dispatchBegin();
+#endif
+
+	while (true)
+	{
+		while (!slot->request_text)
+		{
+			dispatchSleep(&slot->wake);
+		}
+
+		char *response_data = processRequest(slot->request_text);
+		free(slot->request_text);
+		slot->request_text = nullptr;
+
+		hostWriteMsg(makeIdent("REQA"), strlen(response_data), response_data, HostMsgFlag_Final);
+		free(response_data);
+
+		// Anything left over was meant for this request only.
+		while (slot->reply_count)
+		{
+			free(slot->replies[slot->reply_first].data);
+			slot->reply_first = (slot->reply_first + 1) % kRequestMaxReplies;
+			--slot->reply_count;
+		}
+		slot->msg = {};
+		slot->busy = false;
+	}
+
+	return nullptr;
+}
+
+static void dispatchRequest(const HostMsgContext &msg, uint32_t len, void *data)
+{
+	RequestSlot *slot = nullptr;
+	for (RequestSlot &candidate : s_slots)
+	{
+		if (!candidate.busy)
+		{
+			slot = &candidate;
+			break;
+		}
+	}
+
+	if (!slot)
+	{
+		// The host sent more than we told it to.
+		free(data);
+		s_dispatch_msg = msg;
+		const char *busy = "error: busy";
+		hostWriteMsg(makeIdent("REQA"), strlen(busy), busy, HostMsgFlag_Final);
+		s_dispatch_msg = {};
+		return;
+	}
+
+	// Attach null terminator
+	char *request_text = (char *)realloc(data, len + 1);
+	request_text[len] = '\0';
+
+	slot->busy = true;
+	slot->msg = msg;
+	slot->request_text = request_text;
+	dispatchSignal(&slot->wake);
+}
+
+static void dispatchReply(uint32_t ident, uint32_t len, void *data, const HostMsgContext &msg)
+{
+	for (RequestSlot &slot : s_slots)
+	{
+		if (!slot.busy || slot.msg.v2 != msg.v2 || slot.msg.request_id != msg.request_id)
+			continue;
+
+		if (slot.reply_count == kRequestMaxReplies)
+			break;
+
+		uint32_t i = (slot.reply_first + slot.reply_count) % kRequestMaxReplies;
+		slot.replies[i] = { ident, len, data };
+		++slot.reply_count;
+		if (slot.waiting)
+		{
+			dispatchSignal(&slot.wake);
+		}
+		return;
+	}
+
+	// Nobody to take it, the request is gone already.
+	free(data);
+}
+
+void dispatchRun()
+{
+#if OC_HOST_NATIVE
+	s_backend = hostGetBackend();
+	dispatchBegin();
+#else
+	LWP_MutexInit(&s_write_lock, true);
+	LWP_SetThreadPriority(LWP_GetSelf(), kDispatchPriority);
+#endif
+
+	for (uint32_t i = 0; i < kDispatchMaxRequests; ++i)
+	{
+		RequestSlot &slot = s_slots[i];
+		dispatchInitQueue(&slot.wake);
+#if OC_HOST_NATIVE
+		pthread_create(&slot.thread, nullptr, requestThread, &slot);
+#else
+		LWP_CreateThread(&slot.thread, requestThread, &slot, s_request_stacks[i], kRequestStackSize, kRequestPriority);
+#endif
+	}
+
+	while (true)
+	{
+		uint32_t ident, len;
+		void *data;
+		HostMsgContext msg;
+		if (!hostTryReadMsg(&ident, &len, &data, &msg))
+		{
+			// Let requests that are still computing have the CPU.
+			dispatchYield();
+			continue;
+		}
+
+		if (ident == makeIdent("VERQ"))
+		{
+			// Always answered in v1, the host picks the version and how many
+			// requests to send at once from here.
+			free(data);
+			uint32_t version[2] = { kHostProtocolVersion, kDispatchMaxRequests };
+			hostWriteMsg(makeIdent("VERA"), sizeof(version), version);
+			continue;
+		}
+
+		if (ident == makeIdent("REQQ"))
+		{
+			dispatchRequest(msg, len, data);
+			continue;
+		}
+
+		dispatchReply(ident, len, data, msg);
+	}
+}
+
+#endif
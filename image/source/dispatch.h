@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+
+// Runs several requests at once, each on its own thread. Requests run until
+// they wait for a reply from the host, then the others get to run, so host
+// round trips of one request overlap with computation of the others. Needs
+// the v2 protocol so the host can tag its replies with the request id.
+#if OC_MULTI_REQUEST
+
+constexpr uint32_t kDispatchMaxRequests = 4;
+
+// Serves requests forever, replaces the request loop in main().
+[[noreturn]] void dispatchRun();
+
+#endif
@@ -2,68 +2,41 @@
 #include "util.h"
 #include "quant.h"
 #include "host.h"
+#include "profile.h"
+#include "paired.h"
 
 #include <cstring>
 #include <cstdlib>
 #include <cstdio>
 
+#if OC_PROFILE
+// Folded commands are timed together under this name.
+static const char s_fold_profile_name[] = "fold";
+#endif
+
 void Engine::run(const char *request)
 {
 	OC_LOG("run(%s)\n", request);
 
-	// Configure GQR2
-	quant_set_scale(0);
-	quant_set_type(QuantType_UInt16);
+	// Configure GQR2. Written outright, another request may have had the
+	// thread before us.
+	quant_load(quant_make(QuantType_UInt16, 0));
 
-	const char *p = request;
-	const char *rq_end = request + strlen(request);
-	while (*p)
-	{
-		// Skip whitespace
-		if (*p == ' ')
-		{
-			++p;
-			continue;
-		}
+	// Split into commands first, then work out what doesn't depend on
+	// anything but the request text.
+	int request_len = strlen(request);
+	char *text = (char *)malloc(request_len + 1);
+	memcpy(text, request, request_len + 1);
+	// A command and the space after it take two characters at least
+	Instr *program = (Instr *)malloc(sizeof(Instr) * (request_len / 2 + 1));
 
-		// Get one command
-		const char *cmd_end = strchr(p, ' ');
-		if (!cmd_end)
-			cmd_end = rq_end;
-
-		// Extract
-		int buf_len = cmd_end - p;
-		char *buf = (char *)malloc(buf_len + 1);
-		buf[buf_len] = '\0';
-		memcpy(buf, p, buf_len);
-
-		// Split off the argument section
-		// TODO: This entire section is iffy and should be rewritten.
-		char *arg_sep = strchr(buf, ':');
-
-		char *name_buf = nullptr;
-		const char *name;
-		const char *arg;
-		if (arg_sep)
-		{
-			int name_len = arg_sep - buf;
-			name_buf = (char *)malloc(name_len + 1);
-			memcpy(name_buf, buf, name_len);
-			name_buf[name_len] = '\0';
-			name = name_buf;
-			arg = arg_sep;
-		}
-		else
-		{
-			name = buf;
-			arg = "";
-		}
+	int count = parseProgram(text, program);
+	StackValue *fold_pool = optimizeProgram(program, count);
 
+	for (int i = 0; i < count;)
+	{
 		// Run it
-		runCommand(name, arg);
-		free(buf);
-		if (name_buf)
-			free(name_buf);
+		i += runInstr(program[i]);
 
 		// Check for errors
 		// SIC: This happens before the OTP invalidation!
@@ -78,26 +51,47 @@ void Engine::run(const char *request)
 			hostWriteMsg(makeIdent("OTNQ"), 0, nullptr);
 			m_otp_touched = false;
 		}
-
-		// Advance
-		p = cmd_end;
 	}
+
+	if (fold_pool)
+		free(fold_pool);
+	free(program);
+	free(text);
 }
 
-void Engine::runCommand(const char *cmd, const char *arg)
+int Engine::runInstr(const Instr &instr)
 {
-	OC_LOG("runCommand(%s,%s)\n", cmd, arg);
-
-	const CommandInfo *matching_ci = nullptr;
-	for (const CommandInfo *ci = s_commands; ci->name; ++ci)
+	if (instr.kind == InstrKind_Fold && m_stack_size + instr.peak <= (int)OC_ARRAYSIZE(m_stack))
 	{
-		if (!strcmp(ci->name, cmd))
+#if OC_PROFILE
+		uint32_t profile_start = profileTicks();
+#endif
+		for (int i = 0; i < instr.value_count; ++i)
 		{
-			matching_ci = ci;
-			break;
+			putStack(instr.values[i]);
 		}
+#if OC_PROFILE
+		profileCommand(s_fold_profile_name, profileTicks() - profile_start, 0);
+#endif
+		return instr.span;
+	}
+
+	// dup can't overflow and del gets back what dup pushed
+	if (instr.kind == InstrKind_DupDel && m_stack_size > 0 && m_stack_size < (int)OC_ARRAYSIZE(m_stack))
+	{
+		return instr.span;
 	}
 
+	// Otherwise run the command as it was, the ones after it still are.
+	runCommand(instr);
+	return 1;
+}
+
+void Engine::runCommand(const Instr &instr)
+{
+	OC_LOG("runCommand(%.*s,%s)\n", instr.name_len, instr.name, instr.arg);
+
+	const CommandInfo *matching_ci = instr.command;
 	if (!matching_ci)
 	{
 		// Fail
@@ -106,12 +100,19 @@ void Engine::runCommand(const char *cmd, const char *arg)
 	}
 
 	// Execute the command
-	prepareArgs(arg);
+#if OC_PROFILE
+	uint32_t profile_start = profileTicks();
+	uint64_t profile_host_start = profileHostTicks();
+#endif
+	prepareArgs(instr.arg);
 
 	// Prepare args area
 	m_stack_arg_size = m_stack_size;
 
 	(this->*(matching_ci->function))();
+#if OC_PROFILE
+	profileCommand(matching_ci->name, profileTicks() - profile_start, profileHostTicks() - profile_host_start);
+#endif
 }
 
 void Engine::putInt(int v)
@@ -126,16 +127,86 @@ void Engine::putFloat(float v)
 
 void Engine::putStack(StackValue v)
 {
+	if (v.type != StackValueType_Int && v.type != StackValueType_Float && v.type != StackValueType_Vector)
+	{
+		OC_ERR("invalid sv type");
+	}
+
 	if (m_stack_size >= (int)OC_ARRAYSIZE(m_stack))
 	{
 		if (v.type == StackValueType_Float)
 			runtimeError("stack overflow (f%.8g)", v.f);
+		else if (v.type == StackValueType_Vector)
+			runtimeError("stack overflow (v)");
 		else
 			runtimeError("stack overflow (i%d)", v.i);
 		return;
 	}
 
-	m_stack[m_stack_size++] = v;
+	int index = m_stack_size++;
+	uint32_t bit = 1u << (index % 32);
+	m_stack_float[index / 32] &= ~bit;
+	m_stack_vector[index / 32] &= ~bit;
+	if (v.type == StackValueType_Float)
+	{
+		m_stack[index].f = v.f;
+		m_stack_float[index / 32] |= bit;
+	}
+	else
+	{
+		m_stack[index].i = v.i;
+		if (v.type == StackValueType_Vector)
+			m_stack_vector[index / 32] |= bit;
+	}
+}
+
+// Removes count bits at index from a bit set, moving down the ones above,
+// a word at a time. Words are only ever read at or above the one being
+// written, so this works in place.
+static void removeBits(uint32_t *words, int word_count, int used_words, int index, int count)
+{
+	for (int w = index / 32; w < used_words; ++w)
+	{
+		int src = w * 32 + count;
+		int src_word = src / 32;
+		int src_shift = src % 32;
+
+		uint32_t bits = 0;
+		if (src_word < word_count)
+		{
+			bits = words[src_word] >> src_shift;
+			if (src_shift && src_word + 1 < word_count)
+				bits |= words[src_word + 1] << (32 - src_shift);
+		}
+
+		// Bits below index stay where they are
+		if (w == index / 32)
+		{
+			uint32_t keep = (1u << (index % 32)) - 1;
+			bits = (words[w] & keep) | (bits & ~keep);
+		}
+		words[w] = bits;
+	}
+}
+
+void Engine::removeStackEntries(int index, int count)
+{
+	if (!count)
+		return;
+
+	memmove(
+		&m_stack[index],
+		&m_stack[index + count],
+		sizeof(StackEntry) * (m_stack_size - (index + count))
+	);
+
+	// Same for the type bits
+	constexpr int words = OC_ARRAYSIZE(m_stack_float);
+	int used_words = (m_stack_size + 31) / 32;
+	removeBits(m_stack_float, words, used_words, index, count);
+	removeBits(m_stack_vector, words, used_words, index, count);
+
+	m_stack_size -= count;
 }
 
 StackValue Engine::getStack()
@@ -170,7 +241,11 @@ float Engine::getUFloat()
 
 StackValue Engine::readStack()
 {
-	if (m_arg_type == ArgumentType_Paired || m_arg_type == ArgumentType_Float)
+	if (m_arg_type == ArgumentType_Vector)
+	{
+		return StackValue{ .type = StackValueType_Vector, .i = m_arg_value.i };
+	}
+	else if (m_arg_type == ArgumentType_Paired || m_arg_type == ArgumentType_Float)
 	{
 		return StackValue{ .type = StackValueType_Float, .f = readSFloat() };
 	}
@@ -196,6 +271,11 @@ int Engine::readSInt()
 	{
 		return (int)m_arg_value.f;
 	}
+	else if (m_arg_type == ArgumentType_Vector)
+	{
+		runtimeError("expected scalar");
+		return 0;
+	}
 
 	OC_ERR("unknown immediate type");
 }
@@ -215,6 +295,11 @@ int Engine::readUInt()
 	{
 		return ((int)m_arg_value.f) < 0 ? 0 : (int)m_arg_value.f;
 	}
+	else if (m_arg_type == ArgumentType_Vector)
+	{
+		runtimeError("expected scalar");
+		return 0;
+	}
 	else
 	{
 		OC_ERR("unknown immediate type");
@@ -225,9 +310,10 @@ float Engine::readSFloat()
 {
 	if (m_arg_type == ArgumentType_Paired)
 	{
-		quant_set_type(QuantType_Int16);
-		float v = load_gqr2(&m_arg_ps_data[m_arg_next]);
-		OC_LOG("readSFloat paired: gqr = %08x, sf = %f, raw=%04x\n", get_gqr2(), v, m_arg_ps_data[m_arg_next]);
+		// GQR3 is GQR2's scale as signed 16-bit. This still leaves GQR2
+		// unsigned 16-bit, like setting it to signed for the load did.
+		float v = load_gqr3(&m_arg_ps_data[m_arg_next - m_arg_ps_first]);
+		OC_LOG("readSFloat paired: gqr = %08x, sf = %f, raw=%04x\n", quant_signed(quant_get()), v, m_arg_ps_data[m_arg_next - m_arg_ps_first]);
 		quant_set_type(QuantType_UInt16);
 		return v;
 	}
@@ -239,6 +325,11 @@ float Engine::readSFloat()
 	{
 		return m_arg_value.f;
 	}
+	else if (m_arg_type == ArgumentType_Vector)
+	{
+		runtimeError("expected scalar");
+		return 0.f;
+	}
 
 	OC_ERR("unknown immediate type");
 }
@@ -247,8 +338,8 @@ float Engine::readUFloat()
 {
 	if (m_arg_type == ArgumentType_Paired)
 	{
-		float v = load_gqr2(&m_arg_ps_data[m_arg_next]);
-		OC_LOG("readUFloat paired: gqr = %08x, sf = %f, raw=%04x\n", get_gqr2(), v, m_arg_ps_data[m_arg_next]);
+		float v = load_gqr2(&m_arg_ps_data[m_arg_next - m_arg_ps_first]);
+		OC_LOG("readUFloat paired: gqr = %08x, sf = %f, raw=%04x\n", quant_get(), v, m_arg_ps_data[m_arg_next - m_arg_ps_first]);
 		return v;
 	}
 	else if (m_arg_type == ArgumentType_Int)
@@ -259,10 +350,27 @@ float Engine::readUFloat()
 	{
 		return m_arg_value.f < 0.f ? 0.f : m_arg_value.f;
 	}
+	else if (m_arg_type == ArgumentType_Vector)
+	{
+		runtimeError("expected scalar");
+		return 0.f;
+	}
 	
 	OC_ERR("unkown immediate type");
 }
 
+int Engine::readVector()
+{
+	if (m_arg_type == ArgumentType_Vector)
+	{
+		return m_arg_value.i;
+	}
+
+	// Immediates are never vectors
+	runtimeError("expected vector");
+	return -1;
+}
+
 void Engine::prepareArgs(const char *arg)
 {
 	m_arg_text = arg;
@@ -278,6 +386,12 @@ void Engine::prepareNextArg()
 	// Continue parsing existing one if multiple available
 	if (++m_arg_next < m_arg_available)
 	{
+		// Past what was decoded of a paired immediate
+		if (m_arg_type == ArgumentType_Paired && m_arg_next - m_arg_ps_first == k_paired_chunk_size)
+		{
+			m_arg_ps_first = m_arg_next;
+			preparePairedChunk();
+		}
 		return;
 	}
 
@@ -333,17 +447,10 @@ void Engine::prepareNextArg()
 	else if (code == 'p')
 	{
 		m_arg_type = ArgumentType_Paired;
-		// Decompress Base64
-		void *b64_data;
-		int b64_len;
 
-		// Make a null terminated version
-		int b64_text_len = end - m_arg_text;
-		char *b64_text = (char *)alloca(b64_text_len + 1);
-		memcpy(b64_text, m_arg_text, b64_text_len);
-		b64_text[b64_text_len] = '\0';
-		
-		if (!base64Decode(b64_text, &b64_data, &b64_len))
+		// Only validate the Base64 here, values are decoded as they're read
+		int b64_len;
+		if (!base64Check(m_arg_text, end - m_arg_text, &b64_len))
 		{
 			syntaxError("invalid argument: bad paired text");
 			prepareDefaultArg();
@@ -353,26 +460,22 @@ void Engine::prepareNextArg()
 		// One byte for scale, following are pairs for entries
 		if (b64_len < 3 || (b64_len - 1) % sizeof(int16_t) != 0)
 		{
-			free(b64_data);
 			syntaxError("invalid argument: bad paired len");
 			prepareDefaultArg();
 			return;
 		}
 
-		// Read scale and payload
-		int scale = *(int8_t *)b64_data;
-		void *payload = ((uint8_t *)b64_data + 1);
+		// Read scale, the payload follows
+		int8_t scale;
+		base64DecodeRange(m_arg_text, 0, &scale, sizeof(scale));
 		int count = (b64_len - 1) / sizeof(int16_t);
 		OC_LOG("p immediate: scale=%d, count=%d\n", scale, count);
 
-		// Drop any excess
-		if (count > (int)OC_ARRAYSIZE(m_arg_ps_data))
-			count = (int)OC_ARRAYSIZE(m_arg_ps_data);
-
-		memcpy(m_arg_ps_data, payload, count * sizeof(int16_t));
-		free(b64_data);
-
+		m_arg_ps_text = m_arg_text;
+		m_arg_ps_first = 0;
 		m_arg_available = count;
+		preparePairedChunk();
+
 		quant_set_scale(scale);
 	}
 	else
@@ -402,32 +505,27 @@ void Engine::prepareStackArg()
 	}
 
 	// Pop a value off the stack
-	StackValue top = m_stack[--m_stack_arg_size];
-
-	// Move up the rest of the stack
-	// TODO: double check this math.
-	memmove(
-		&m_stack[m_stack_arg_size],
-		&m_stack[m_stack_arg_size + 1],
-		sizeof(StackValue) * (m_stack_size - (m_stack_arg_size + 1))
-	);
-	--m_stack_size;
+	int top = --m_stack_arg_size;
 
 	// Prepare
-	if (top.type == StackValueType_Int)
+	if (isStackVector(top))
 	{
-		m_arg_type = ArgumentType_Int;
-		m_arg_value.i = top.i;
+		m_arg_type = ArgumentType_Vector;
+		m_arg_value.i = m_stack[top].i;
 	}
-	else if (top.type == StackValueType_Float)
+	else if (isStackFloat(top))
 	{
 		m_arg_type = ArgumentType_Float;
-		m_arg_value.f = top.f;
+		m_arg_value.f = m_stack[top].f;
 	}
 	else
 	{
-		OC_ERR("invalid sv type");
+		m_arg_type = ArgumentType_Int;
+		m_arg_value.i = m_stack[top].i;
 	}
+
+	// Move up the rest of the stack
+	removeStackEntries(top, 1);
 }
 
 void Engine::prepareDefaultArg()
@@ -436,6 +534,17 @@ void Engine::prepareDefaultArg()
 	m_arg_value.i = 0;
 }
 
+void Engine::preparePairedChunk()
+{
+	int count = m_arg_available - m_arg_ps_first;
+	if (count > k_paired_chunk_size)
+		count = k_paired_chunk_size;
+
+	// Scale byte first
+	int offset = 1 + m_arg_ps_first * sizeof(int16_t);
+	base64DecodeRange(m_arg_ps_text, offset, m_arg_ps_data, count * sizeof(int16_t));
+}
+
 bool Engine::hasError()
 {
 	return m_error_text[0] ? true : false;
@@ -475,41 +584,51 @@ void Engine::print(const char *text)
 	hostWriteMsg(makeIdent("PRTQ"), strlen(text), text);
 }
 
+// vsnprintf() at *pos, then moves *pos past what was written. Whatever
+// doesn't fit before end is cut off, the buffer stays terminated.
+static void appendf(char **pos, char *end, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(*pos, end - *pos, fmt, args);
+	va_end(args);
+	if (len < 0)
+		return;
+	*pos += len < end - *pos ? len : end - *pos - 1;
+}
+
 void Engine::dumpStack(char *buffer, int size)
 {
-	int left = size;
+	// Appending through pos, strncat() would walk everything before again
+	char *pos = buffer;
+	char *end = buffer + size;
 	buffer[0] = '\0';
 
-	const char *prefix = "out:";
-	strncat(buffer, prefix, left);
-	left -= strlen(prefix);
-
-	// Entries can take more space than one might think because of big floats
-	char item_buffer[64];
+	appendf(&pos, end, "out:");
 	for (int i = m_stack_size; i > 0; --i)
 	{
-		StackValue sv = m_stack[i - 1];
-		if (sv.type == StackValueType_Int)
+		if (isStackVector(i - 1))
 		{
-			snprintf(item_buffer, OC_ARRAYSIZE(item_buffer), " i%d", sv.i);
-			item_buffer[OC_ARRAYSIZE(item_buffer) - 1] = '\0';
+			int handle = m_stack[i - 1].i;
+			const float *data = getVectorData(handle);
+			int vector_size = getVectorSize(handle);
+
+			appendf(&pos, end, " v[");
+			for (int j = 0; j < vector_size; ++j)
+			{
+				appendf(&pos, end, j ? ",%.9g" : "%.9g", data[j]);
+			}
+			appendf(&pos, end, "]");
 		}
-		else if (sv.type == StackValueType_Float)
+		else if (isStackFloat(i - 1))
 		{
-			snprintf(item_buffer, OC_ARRAYSIZE(item_buffer), " f%.9g", sv.f);
-			item_buffer[OC_ARRAYSIZE(item_buffer) - 1] = '\0';
+			appendf(&pos, end, " f%.9g", m_stack[i - 1].f);
 		}
 		else
 		{
-			OC_ERR("bad sv type");
+			appendf(&pos, end, " i%d", m_stack[i - 1].i);
 		}
-
-		// todo: is this safe?
-		strncat(buffer, item_buffer, left);
-		left -= strlen(item_buffer);
 	}
-
-	buffer[size - 1] = '\0';
 }
 
 int Engine::getStackSize()
@@ -517,28 +636,106 @@ int Engine::getStackSize()
 	return m_stack_size;
 }
 
+int Engine::getDumpSize()
+{
+	// Entries that share a vector after dup or rpt dump it once each, so
+	// count what ends up in the reply rather than what is allocated.
+	int vector_elements = 0;
+	for (int i = 0; i < m_stack_size; ++i)
+	{
+		if (isStackVector(i))
+			vector_elements += getVectorSize(m_stack[i].i);
+	}
+	if (vector_elements > k_dump_vector_max)
+	{
+		runtimeError("output too large");
+		return 0;
+	}
+
+	// Entries can take more space than one might think because of big
+	// floats, vector elements are shorter
+	return 16 + m_stack_size * 64 + vector_elements * 24;
+}
+
+int Engine::allocVector(int size)
+{
+	// Keep every vector on a pair
+	int space = (size + 1) & ~1;
+	if (m_vector_count >= k_vector_max || space > k_vector_storage_size - m_vector_storage_used)
+	{
+		runtimeError("out of vector memory");
+		return -1;
+	}
+
+	VectorInfo &info = m_vectors[m_vector_count];
+	info.offset = m_vector_storage_used;
+	info.size = size;
+	m_vector_storage_used += space;
+	return m_vector_count++;
+}
+
+void Engine::releaseVectors(int a, int b)
+{
+	// Newest first, that one might be in the way of the other
+	int handles[2] = { a > b ? a : b, a > b ? b : a };
+	for (int handle : handles)
+	{
+		if (handle < 0 || handle != m_vector_count - 1)
+			return;
+
+		// Still on the stack?
+		for (int i = 0; i < m_stack_size; ++i)
+		{
+			if (isStackVector(i) && m_stack[i].i == handle)
+				return;
+		}
+
+		m_vector_storage_used = m_vectors[handle].offset;
+		--m_vector_count;
+	}
+}
+
+int Engine::getVectorSize(int handle)
+{
+	return handle < 0 ? 0 : m_vectors[handle].size;
+}
+
+float *Engine::getVectorData(int handle)
+{
+	return handle < 0 ? m_vector_storage : &m_vector_storage[m_vectors[handle].offset];
+}
+
+static char *makeErrorResponse(const char *err_text)
+{
+	const char *err_prefix = "error: ";
+	char *out = (char *)malloc(strlen(err_prefix) + strlen(err_text) + 1);
+	if (!out)
+	{
+		OC_ERR("out of memory for the response%s", "");
+	}
+	out[0] = '\0';
+	strcat(out, err_prefix);
+	strcat(out, err_text);
+	return out;
+}
+
 char *processRequest(const char *request_data)
 {
 	// Parse commands
 	Engine e;
 	e.run(request_data);
 
+	// Fails if the output would be too large
+	int buffer_size = e.hasError() ? 0 : e.getDumpSize();
 	if (e.hasError())
-	{
-		const char *err_text = e.getError();
-		const char *err_prefix = "error: ";
-		char *out = (char *)malloc(strlen(err_prefix) + strlen(err_text) + 1);
-		out[0] = '\0';
-		strcat(out, err_prefix);
-		strcat(out, err_text);
-		return out;
-	}
+		return makeErrorResponse(e.getError());
 
 	// Dump stack
 	// Size should be sufficient for everything.
-	int buffer_size = 16 + e.getStackSize() * 64;
 	char *buffer = (char *)malloc(buffer_size);
+	if (!buffer)
+		return makeErrorResponse("out of memory");
 	e.dumpStack(buffer, buffer_size);
 
 	return buffer;
-}
\ No newline at end of file
+}
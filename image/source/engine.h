@@ -7,11 +7,16 @@
 #include <cstdarg>
 #include <cstdlib>
 #include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
 enum StackValueType
 {
 	StackValueType_Int,
 	StackValueType_Float,
+	// Handle to the engine's vector storage, never sent to the host
+	StackValueType_Vector,
 };
 
 enum ArgumentType
@@ -19,6 +24,16 @@ enum ArgumentType
 	ArgumentType_Int,
 	ArgumentType_Float,
 	ArgumentType_Paired,
+	ArgumentType_Vector,
+};
+
+// Properties of a command, see Engine::CommandInfo
+enum CommandFlag
+{
+	// Computes its results from its arguments alone: no host messages, no
+	// GQR2, no vector storage. Engine::foldInstr() knows how, so runs of
+	// these over immediates are evaluated before the request runs.
+	CommandFlag_Pure = 1 << 0,
 };
 
 struct StackValue
@@ -31,6 +46,22 @@ struct StackValue
 	};
 } __attribute__((__packed__));
 
+// Argument kinds for Engine::getArgs(), each converts like the matching
+// getSInt()/getUInt()/getSFloat()/getUFloat()/getStack().
+namespace Arg
+{
+struct SInt { using Type = int; };
+struct UInt { using Type = int; };
+struct SFloat { using Type = float; };
+struct UFloat { using Type = float; };
+struct Stack { using Type = StackValue; };
+// Vector handle, see Engine::allocVector()
+struct Vector { using Type = int; };
+}
+
+template <typename... Kinds>
+using Args = std::tuple<typename Kinds::Type...>;
+
 class Engine;
 
 class CustomArgParser
@@ -78,9 +109,22 @@ public:
 
 	void dumpStack(char *buffer, int size);
 	int getStackSize();
+	int getDumpSize();
 
 private:
-	void runCommand(const char *cmd, const char *arg);
+	struct CommandInfo;
+	struct Instr;
+	struct FoldStack;
+
+	void runCommand(const Instr &instr);
+
+	// Request program, see engine_opt.cpp
+	int parseProgram(char *text, Instr *program);
+	// Returns what holds the folded values, to be freed after the request
+	StackValue *optimizeProgram(Instr *program, int count);
+	bool foldInstr(const Instr &instr, FoldStack &fold);
+	// Returns how many commands it ran or skipped
+	int runInstr(const Instr &instr);
 
 	// Argument and stack handling
 	void putStack(StackValue v);
@@ -98,12 +142,45 @@ private:
 	int readUInt();
 	float readSFloat();
 	float readUFloat();
+	int readVector();
+
+	// All arguments of a command in one go, e.g.
+	//   auto [lhs, rhs] = getArgs<Arg::SInt, Arg::SInt>();
+	// Once only the stack is left they are popped together, without going
+	// through prepareNextArg() for each.
+	template <typename... Kinds>
+	Args<Kinds...> getArgs();
+	template <typename Kind>
+	typename Kind::Type getArg();
+	template <typename... Kinds, size_t... Indices>
+	Args<Kinds...> popArgs(std::index_sequence<Indices...>);
+	template <typename Kind>
+	typename Kind::Type convertArg(StackValue v);
+	bool onlyStackArgsLeft();
+
+	// count arguments of one kind into out, for commands that take a
+	// variable number. The stack part is popped in one go as well.
+	template <typename Kind>
+	void getArgArray(typename Kind::Type *out, int count);
+
+	// Stack storage, see m_stack
+	bool isStackFloat(int index);
+	bool isStackVector(int index);
+	StackValue readStackEntry(int index);
+	void removeStackEntries(int index, int count);
 
 	void prepareArgs(const char *arg);
 	void prepareNextArg();
 
 	void prepareStackArg();
 	void prepareDefaultArg();
+	void preparePairedChunk();
+
+	// Vector storage, see m_vectors
+	int allocVector(int size);
+	void releaseVectors(int a, int b = -1);
+	int getVectorSize(int handle);
+	float *getVectorData(int handle);
 
 	// Error handling
 	void syntaxError(const char *fmt, ...);
@@ -138,6 +215,19 @@ private:
 	void cmd_otp_auth();
 	void cmd_otp_sync();
 
+	void cmd_vec();
+	void cmd_vaddf();
+	void cmd_vmulf();
+	void cmd_vscale();
+	void cmd_vsumf();
+	void cmd_vdotf();
+
+	void cmd_sumi();
+	void cmd_sumf();
+	void cmd_minf();
+	void cmd_maxf();
+	void cmd_scanf();
+
 	void cmd_inspect();
 	void cmd_print();
 #if !OC_MINIMAL_DOCS
@@ -149,23 +239,57 @@ private:
 #endif
 
 private:
-	StackValue m_stack[256] = {};
+	// Values and types are kept apart, the type only needs a bit or two.
+	// Bit n of m_stack_float/m_stack_vector is set if m_stack[n] is a float
+	// or a vector handle. StackValue is only used to pass single values
+	// around and on the wire.
+	union StackEntry
+	{
+		float f;
+		int i;
+	};
+	StackEntry m_stack[256] = {};
+	uint32_t m_stack_float[OC_ARRAYSIZE(m_stack) / 32] = {};
+	uint32_t m_stack_vector[OC_ARRAYSIZE(m_stack) / 32] = {};
 	int m_stack_size = 0;
 	int m_stack_arg_size = 0;
 
 	// Data for current command
 	const char *m_arg_text;
 
-	constexpr static int k_paired_argument_max = 32;
+	// Paired immediates are decoded from the argument text as they're read,
+	// this many values at a time.
+	constexpr static int k_paired_chunk_size = 32;
 	int m_arg_type;
 	int m_arg_next;
 	int m_arg_available;
+	const char *m_arg_ps_text;
+	int m_arg_ps_first;
 	union
 	{
 		StackValue m_arg_value;
-		uint16_t m_arg_ps_data[k_paired_argument_max];
+		uint16_t m_arg_ps_data[k_paired_chunk_size];
 	};
 
+	// Vectors live here for the whole request and never change once built,
+	// so stack entries can share them. Storage is taken in order and only
+	// the newest vector can be given back, see releaseVectors(). Every vector
+	// starts on a pair.
+	struct VectorInfo
+	{
+		uint16_t offset;
+		uint16_t size;
+	};
+	constexpr static int k_vector_max = 64;
+	constexpr static int k_vector_storage_size = 2048;
+	// Vector elements in a reply, over all entries. dup and rpt only copy
+	// the handle, without this a short request could ask for megabytes.
+	constexpr static int k_dump_vector_max = 256;
+	VectorInfo m_vectors[k_vector_max];
+	int m_vector_count = 0;
+	int m_vector_storage_used = 0;
+	float m_vector_storage[k_vector_storage_size] __attribute__((aligned(32)));
+
 	// Authentication
 	bool m_user_authenticated = false;
 	int m_user_uid0 = 0;
@@ -181,6 +305,8 @@ private:
 	{
 		const char *name = nullptr;
 		void (Engine::*function)() = nullptr;
+		// CommandFlag_*
+		uint32_t flags = 0;
 #if !OC_MINIMAL_DOCS
 		const char *help = nullptr;
 #endif
@@ -188,7 +314,188 @@ private:
 	
 	const static CommandInfo s_commands[];
 
+	// One command of the request. The optimizer may replace a run of them
+	// with what they leave on the stack, the commands stay in place in case
+	// the shortcut doesn't apply when it's reached.
+	enum InstrKind
+	{
+		InstrKind_Command,
+		// Pushes values[0..value_count), given the stack has room for peak
+		// more entries, then skips the span commands it stands for.
+		InstrKind_Fold,
+		// dup and del without arguments, nothing happens unless the stack is
+		// empty or full.
+		InstrKind_DupDel,
+	};
+	struct Instr
+	{
+		int kind;
+		int span;
+		int peak;
+		int value_count;
+		const StackValue *values;
+		// Command to run, nullptr if the name didn't match any
+		const CommandInfo *command;
+		// Not terminated, the argument section follows it
+		const char *name;
+		int name_len;
+		// Argument section starting at the first ':', or ""
+		const char *arg;
+	};
+	// Values left by all folds of a request together
+	constexpr static int k_fold_pool_size = 256;
+
 	friend class CustomArgParser;
 };
 
+template <typename... Kinds>
+inline Args<Kinds...> Engine::getArgs()
+{
+	if (onlyStackArgsLeft())
+	{
+		return popArgs<Kinds...>(std::index_sequence_for<Kinds...>());
+	}
+
+	// Braces keep the order
+	return Args<Kinds...>{ getArg<Kinds>()... };
+}
+
+template <typename Kind>
+inline typename Kind::Type Engine::getArg()
+{
+	prepareNextArg();
+	if constexpr (std::is_same_v<Kind, Arg::SInt>)
+		return readSInt();
+	else if constexpr (std::is_same_v<Kind, Arg::UInt>)
+		return readUInt();
+	else if constexpr (std::is_same_v<Kind, Arg::SFloat>)
+		return readSFloat();
+	else if constexpr (std::is_same_v<Kind, Arg::UFloat>)
+		return readUFloat();
+	else if constexpr (std::is_same_v<Kind, Arg::Vector>)
+		return readVector();
+	else
+		return readStack();
+}
+
+template <typename... Kinds, size_t... Indices>
+inline Args<Kinds...> Engine::popArgs(std::index_sequence<Indices...>)
+{
+	constexpr int count = sizeof...(Kinds);
+
+	// Same as prepareStackArg() count times: top of the argument area first,
+	// zeroes once it's empty.
+	StackValue values[count];
+	int popped = m_stack_arg_size < count ? m_stack_arg_size : count;
+	for (int i = 0; i < popped; ++i)
+	{
+		values[i] = readStackEntry(m_stack_arg_size - 1 - i);
+	}
+	for (int i = popped; i < count; ++i)
+	{
+		values[i] = StackValue{ .type = StackValueType_Int, .i = 0 };
+	}
+
+	// Move up the rest of the stack
+	removeStackEntries(m_stack_arg_size - popped, popped);
+	m_stack_arg_size -= popped;
+
+	return Args<Kinds...>{ convertArg<Kinds>(values[Indices])... };
+}
+
+template <typename Kind>
+inline void Engine::getArgArray(typename Kind::Type *out, int count)
+{
+	// Immediates one by one
+	int i = 0;
+	for (; i < count && !onlyStackArgsLeft(); ++i)
+	{
+		out[i] = getArg<Kind>();
+	}
+
+	// The rest like popArgs()
+	int popped = count - i < m_stack_arg_size ? count - i : m_stack_arg_size;
+	for (int j = 0; j < popped; ++j)
+	{
+		out[i + j] = convertArg<Kind>(readStackEntry(m_stack_arg_size - 1 - j));
+	}
+	removeStackEntries(m_stack_arg_size - popped, popped);
+	m_stack_arg_size -= popped;
+
+	for (i += popped; i < count; ++i)
+	{
+		out[i] = convertArg<Kind>(StackValue{ .type = StackValueType_Int, .i = 0 });
+	}
+}
+
+template <typename Kind>
+inline typename Kind::Type Engine::convertArg(StackValue v)
+{
+	if constexpr (std::is_same_v<Kind, Arg::Stack>)
+	{
+		return v;
+	}
+	else if constexpr (std::is_same_v<Kind, Arg::Vector>)
+	{
+		if (v.type != StackValueType_Vector)
+		{
+			runtimeError("expected vector");
+			return -1;
+		}
+		return v.i;
+	}
+	else
+	{
+		if (v.type == StackValueType_Vector)
+		{
+			runtimeError("expected scalar");
+			return 0;
+		}
+
+		if constexpr (std::is_same_v<Kind, Arg::SInt>)
+		{
+			return v.type == StackValueType_Int ? v.i : (int)v.f;
+		}
+		else if constexpr (std::is_same_v<Kind, Arg::UInt>)
+		{
+			int i = v.type == StackValueType_Int ? v.i : (int)v.f;
+			return i < 0 ? 0 : i;
+		}
+		else if constexpr (std::is_same_v<Kind, Arg::SFloat>)
+		{
+			return v.type == StackValueType_Int ? (float)v.i : v.f;
+		}
+		else
+		{
+			float f = v.type == StackValueType_Int ? (float)v.i : v.f;
+			return f < 0.f ? 0.f : f;
+		}
+	}
+}
+
+// Nothing left in the argument text or a paired immediate
+inline bool Engine::onlyStackArgsLeft()
+{
+	return !*m_arg_text && m_arg_next + 1 >= m_arg_available;
+}
+
+inline bool Engine::isStackFloat(int index)
+{
+	return (m_stack_float[index / 32] >> (index % 32)) & 1;
+}
+
+inline bool Engine::isStackVector(int index)
+{
+	return (m_stack_vector[index / 32] >> (index % 32)) & 1;
+}
+
+inline StackValue Engine::readStackEntry(int index)
+{
+	if (isStackVector(index))
+		return StackValue{ .type = StackValueType_Vector, .i = m_stack[index].i };
+	if (isStackFloat(index))
+		return StackValue{ .type = StackValueType_Float, .f = m_stack[index].f };
+	return StackValue{ .type = StackValueType_Int, .i = m_stack[index].i };
+}
+
 char *processRequest(const char *request_data);
\ No newline at end of file
@@ -9,7 +9,7 @@ CustomArgParser::~CustomArgParser()
 {
 	if (m_gqr_dirty)
 	{
-		set_gqr2(m_gqr_saved);
+		quant_set(m_gqr_saved);
 	}
 }
 
@@ -140,6 +140,6 @@ void CustomArgParser::setQuantDirty()
 	if (!m_gqr_dirty)
 	{
 		m_gqr_dirty = true;
-		m_gqr_saved = get_gqr2();
+		m_gqr_saved = quant_get();
 	}
 }
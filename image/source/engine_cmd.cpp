@@ -2,49 +2,63 @@
 
 #include "engine.h"
 #include "host.h"
+#include "paired.h"
 
 #if !OC_MINIMAL_DOCS
-#define OC_DEFINE_CMD(name, help) \
-	{ #name, &Engine::cmd_##name, help }
+#define OC_DEFINE_CMD(name, flags, help) \
+	{ #name, &Engine::cmd_##name, flags, help }
 #else
-#define OC_DEFINE_CMD(name, help) \
-	{ #name, &Engine::cmd_##name }
+#define OC_DEFINE_CMD(name, flags, help) \
+	{ #name, &Engine::cmd_##name, flags }
 #endif
 
 const Engine::CommandInfo Engine::s_commands[] = {
-	OC_DEFINE_CMD(int,   "read/write integer"),
-	OC_DEFINE_CMD(float, "read/write float"),
-	OC_DEFINE_CMD(dup,   "repeat single"),
-	OC_DEFINE_CMD(rpt,   "repeat multiple"),
-	OC_DEFINE_CMD(del,   "delete single"),
-	OC_DEFINE_CMD(drop,  "repeat multiple"),
-	OC_DEFINE_CMD(stack, "read/write stack"),
-
-	OC_DEFINE_CMD(addi, "add integers"),
-	OC_DEFINE_CMD(addf, "add floats"),
-	OC_DEFINE_CMD(muli, "multiply integers"),
-	OC_DEFINE_CMD(mulf, "multiply floats"),
-
-	OC_DEFINE_CMD(poly,   "evaluate polynomial"),
-	OC_DEFINE_CMD(weight, "evaluate linear combination"),
-
-	OC_DEFINE_CMD(user,  "login/register as user"),
-	OC_DEFINE_CMD(getn,  "get saved number"),
-	OC_DEFINE_CMD(setn,  "set saved number"),
-	OC_DEFINE_CMD(lockn, "lock saved number from writing"),
-
-	OC_DEFINE_CMD(otp_init, "register as user with one-time passwords"),
-	OC_DEFINE_CMD(otp_auth, "login as user with one-time passwords"),
-	OC_DEFINE_CMD(otp_sync, "synchronize as user with one-time passwords"),
-
-	OC_DEFINE_CMD(inspect, "print integers/floats"),
-	OC_DEFINE_CMD(print,   "print text"),
+	OC_DEFINE_CMD(int,   CommandFlag_Pure, "read/write integer"),
+	OC_DEFINE_CMD(float, CommandFlag_Pure, "read/write float"),
+	OC_DEFINE_CMD(dup,   CommandFlag_Pure, "repeat single"),
+	OC_DEFINE_CMD(rpt,   CommandFlag_Pure, "repeat multiple"),
+	OC_DEFINE_CMD(del,   CommandFlag_Pure, "delete single"),
+	OC_DEFINE_CMD(drop,  CommandFlag_Pure, "repeat multiple"),
+	OC_DEFINE_CMD(stack, CommandFlag_Pure, "read/write stack"),
+
+	OC_DEFINE_CMD(addi, CommandFlag_Pure, "add integers"),
+	OC_DEFINE_CMD(addf, CommandFlag_Pure, "add floats"),
+	OC_DEFINE_CMD(muli, CommandFlag_Pure, "multiply integers"),
+	OC_DEFINE_CMD(mulf, CommandFlag_Pure, "multiply floats"),
+
+	OC_DEFINE_CMD(poly,   0, "evaluate polynomial"),
+	OC_DEFINE_CMD(weight, 0, "evaluate linear combination"),
+
+	OC_DEFINE_CMD(user,  0, "login/register as user"),
+	OC_DEFINE_CMD(getn,  0, "get saved number"),
+	OC_DEFINE_CMD(setn,  0, "set saved number"),
+	OC_DEFINE_CMD(lockn, 0, "lock saved number from writing"),
+
+	OC_DEFINE_CMD(otp_init, 0, "register as user with one-time passwords"),
+	OC_DEFINE_CMD(otp_auth, 0, "login as user with one-time passwords"),
+	OC_DEFINE_CMD(otp_sync, 0, "synchronize as user with one-time passwords"),
+
+	OC_DEFINE_CMD(vec,    0, "make vector of floats"),
+	OC_DEFINE_CMD(vaddf,  0, "add vectors"),
+	OC_DEFINE_CMD(vmulf,  0, "multiply vectors elementwise"),
+	OC_DEFINE_CMD(vscale, 0, "multiply vector by float"),
+	OC_DEFINE_CMD(vsumf,  0, "sum of vector"),
+	OC_DEFINE_CMD(vdotf,  0, "dot product of vectors"),
+
+	OC_DEFINE_CMD(sumi,  CommandFlag_Pure, "sum of integers"),
+	OC_DEFINE_CMD(sumf,  0, "sum of floats"),
+	OC_DEFINE_CMD(minf,  0, "minimum of floats"),
+	OC_DEFINE_CMD(maxf,  0, "maximum of floats"),
+	OC_DEFINE_CMD(scanf, 0, "running sums of floats"),
+
+	OC_DEFINE_CMD(inspect, 0, "print integers/floats"),
+	OC_DEFINE_CMD(print,   0, "print text"),
 #if !OC_MINIMAL_DOCS
-	OC_DEFINE_CMD(help,    "print help"),
+	OC_DEFINE_CMD(help,    0, "print help"),
 #endif
 
 #if !OC_FINAL
-	OC_DEFINE_CMD(dbg_fail, "force a fatal error"),
+	OC_DEFINE_CMD(dbg_fail, 0, "force a fatal error"),
 #endif
 
 	{ nullptr, nullptr }
@@ -52,25 +66,26 @@ const Engine::CommandInfo Engine::s_commands[] = {
 
 void Engine::cmd_int()
 {
-	putInt(getSInt());
+	auto [v] = getArgs<Arg::SInt>();
+	putInt(v);
 }
 
 void Engine::cmd_float()
 {
-	putFloat(getSFloat());
+	auto [v] = getArgs<Arg::SFloat>();
+	putFloat(v);
 }
 
 void Engine::cmd_dup()
 {
-	StackValue sv = getStack();
+	auto [sv] = getArgs<Arg::Stack>();
 	putStack(sv);
 	putStack(sv);
 }
 
 void Engine::cmd_rpt()
 {
-	int count = getUInt();
-	StackValue sv = getStack();
+	auto [count, sv] = getArgs<Arg::UInt, Arg::Stack>();
 	for (int i = 0; i < count; ++i)
 	{
 		putStack(sv);
@@ -93,42 +108,37 @@ void Engine::cmd_drop()
 
 void Engine::cmd_stack()
 {
-	putStack(getStack());
+	auto [sv] = getArgs<Arg::Stack>();
+	putStack(sv);
 }
 
 void Engine::cmd_addi()
 {
-	int lhs = getSInt();
-	int rhs = getSInt();
+	auto [lhs, rhs] = getArgs<Arg::SInt, Arg::SInt>();
 	putInt(lhs + rhs);
 }
 
 void Engine::cmd_addf()
 {
-	float lhs = getSFloat();
-	float rhs = getSFloat();
+	auto [lhs, rhs] = getArgs<Arg::SFloat, Arg::SFloat>();
 	putFloat(lhs + rhs);
 }
 
 void Engine::cmd_muli()
 {
-	int lhs = getSInt();
-	int rhs = getSInt();
+	auto [lhs, rhs] = getArgs<Arg::SInt, Arg::SInt>();
 	putInt(lhs * rhs);
 }
 
 void Engine::cmd_mulf()
 {
-	float lhs = getSFloat();
-	float rhs = getSFloat();
+	auto [lhs, rhs] = getArgs<Arg::SFloat, Arg::SFloat>();
 	putFloat(lhs * rhs);
 }
 
 void Engine::cmd_poly()
 {
-	int count = getUInt();
-
-	float x = getSFloat();
+	auto [count, x] = getArgs<Arg::UInt, Arg::SFloat>();
 
 	float xp = 1.f;
 	float y = 0.f;
@@ -208,10 +218,7 @@ void Engine::cmd_user()
 	};
 
 	// Get args
-	int uid0 = getSInt();
-	int uid1 = getSInt();
-	int key0 = getSInt();
-	int key1 = getSInt();
+	auto [uid0, uid1, key0, key1] = getArgs<Arg::SInt, Arg::SInt, Arg::SInt, Arg::SInt>();
 
 	constexpr int kKey0Idx = 0x20000000;
 	constexpr int kKey1Idx = 0x20000001;
@@ -280,8 +287,16 @@ void Engine::cmd_setn()
 		StackValue sv;
 	} setn_buffer;
 
-	setn_buffer.idx = getSInt();
-	setn_buffer.sv = getStack();
+	auto [idx, sv] = getArgs<Arg::SInt, Arg::Stack>();
+	setn_buffer.idx = idx;
+	setn_buffer.sv = sv;
+
+	// Handles mean nothing outside of this request
+	if (sv.type == StackValueType_Vector)
+	{
+		runtimeError("can't save vectors");
+		return;
+	}
 
 	if (!m_user_authenticated)
 		return;
@@ -301,7 +316,8 @@ void Engine::cmd_getn()
 		int idx;
 	} getn_buffer;
 
-	getn_buffer.idx = getSInt();
+	auto [idx] = getArgs<Arg::SInt>();
+	getn_buffer.idx = idx;
 
 	if (!m_user_authenticated)
 	{
@@ -328,6 +344,11 @@ void Engine::cmd_getn()
 	StackValue sv;
 	memcpy(&sv, gtna_data, sizeof(sv));
 	free(gtna_data);
+	if (sv.type == StackValueType_Vector)
+	{
+		runtimeError("bad answer for getn command");
+		return;
+	}
 	putStack(sv);
 }
 
@@ -340,7 +361,8 @@ void Engine::cmd_lockn()
 		int idx;
 	} lockn_buffer;
 
-	lockn_buffer.idx = getUInt();
+	auto [idx] = getArgs<Arg::UInt>();
+	lockn_buffer.idx = idx;
 
 	if (!m_user_authenticated)
 		return;
@@ -359,8 +381,9 @@ void Engine::cmd_otp_init()
 		int uid1;
 	} otp_init_buffer;
 
-	otp_init_buffer.uid0 = getSInt();
-	otp_init_buffer.uid1 = getSInt();
+	auto [uid0, uid1] = getArgs<Arg::SInt, Arg::SInt>();
+	otp_init_buffer.uid0 = uid0;
+	otp_init_buffer.uid1 = uid1;
 
 	hostWriteMsg(makeIdent("OTIQ"), sizeof(otp_init_buffer), &otp_init_buffer);
 
@@ -393,10 +416,7 @@ void Engine::cmd_otp_init()
 
 void Engine::cmd_otp_auth()
 {
-	int uid0 = getSInt();
-	int uid1 = getSInt();
-	int otp0 = getSInt();
-	int otp1 = getSInt();
+	auto [uid0, uid1, otp0, otp1] = getArgs<Arg::SInt, Arg::SInt, Arg::SInt, Arg::SInt>();
 
 	struct __attribute__((__packed__))
 	{
@@ -442,8 +462,7 @@ void Engine::cmd_otp_auth()
 
 void Engine::cmd_otp_sync()
 {
-	int uid0 = getSInt();
-	int uid1 = getSInt();
+	auto [uid0, uid1] = getArgs<Arg::SInt, Arg::SInt>();
 
 	struct __attribute__((__packed__))
 	{
@@ -481,18 +500,194 @@ void Engine::cmd_otp_sync()
 	m_otp_touched = true;
 }
 
+void Engine::cmd_vec()
+{
+	int count = getUInt();
+	int v = allocVector(count);
+	if (v < 0)
+		return;
+
+	float *data = getVectorData(v);
+	for (int i = 0; i < count; ++i)
+	{
+		data[i] = getSFloat();
+	}
+
+	putStack(StackValue{ .type = StackValueType_Vector, .i = v });
+}
+
+void Engine::cmd_vaddf()
+{
+	auto [lhs, rhs] = getArgs<Arg::Vector, Arg::Vector>();
+	int size = getVectorSize(lhs);
+	if (getVectorSize(rhs) != size)
+	{
+		runtimeError("vector size mismatch");
+		return;
+	}
+
+	// The result can take the place of operands nobody else uses
+	releaseVectors(lhs, rhs);
+	int out = allocVector(size);
+	if (out < 0)
+		return;
+
+	pairedAdd(getVectorData(out), getVectorData(lhs), getVectorData(rhs), size);
+	putStack(StackValue{ .type = StackValueType_Vector, .i = out });
+}
+
+void Engine::cmd_vmulf()
+{
+	auto [lhs, rhs] = getArgs<Arg::Vector, Arg::Vector>();
+	int size = getVectorSize(lhs);
+	if (getVectorSize(rhs) != size)
+	{
+		runtimeError("vector size mismatch");
+		return;
+	}
+
+	releaseVectors(lhs, rhs);
+	int out = allocVector(size);
+	if (out < 0)
+		return;
+
+	pairedMul(getVectorData(out), getVectorData(lhs), getVectorData(rhs), size);
+	putStack(StackValue{ .type = StackValueType_Vector, .i = out });
+}
+
+void Engine::cmd_vscale()
+{
+	auto [s, v] = getArgs<Arg::SFloat, Arg::Vector>();
+	int size = getVectorSize(v);
+
+	releaseVectors(v);
+	int out = allocVector(size);
+	if (out < 0)
+		return;
+
+	pairedScale(getVectorData(out), getVectorData(v), s, size);
+	putStack(StackValue{ .type = StackValueType_Vector, .i = out });
+}
+
+void Engine::cmd_vsumf()
+{
+	auto [v] = getArgs<Arg::Vector>();
+	float sum = pairedSum(getVectorData(v), getVectorSize(v));
+	releaseVectors(v);
+	putFloat(sum);
+}
+
+void Engine::cmd_vdotf()
+{
+	auto [lhs, rhs] = getArgs<Arg::Vector, Arg::Vector>();
+	int size = getVectorSize(lhs);
+	if (getVectorSize(rhs) != size)
+	{
+		runtimeError("vector size mismatch");
+		return;
+	}
+
+	float dot = pairedDot(getVectorData(lhs), getVectorData(rhs), size);
+	releaseVectors(lhs, rhs);
+	putFloat(dot);
+}
+
+// The reductions take a count and then that many values, as many as fit
+// on the stack.
+void Engine::cmd_sumi()
+{
+	int count = getUInt();
+	if (count > (int)OC_ARRAYSIZE(m_stack))
+	{
+		runtimeError("count too large");
+		return;
+	}
+
+	int values[OC_ARRAYSIZE(m_stack)];
+	getArgArray<Arg::SInt>(values, count);
+
+	// Wraps around like addi
+	uint32_t sum = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		sum += (uint32_t)values[i];
+	}
+	putInt((int)sum);
+}
+
+void Engine::cmd_sumf()
+{
+	int count = getUInt();
+	if (count > (int)OC_ARRAYSIZE(m_stack))
+	{
+		runtimeError("count too large");
+		return;
+	}
+
+	float values[OC_ARRAYSIZE(m_stack)] __attribute__((aligned(8)));
+	getArgArray<Arg::SFloat>(values, count);
+	putFloat(pairedSum(values, count));
+}
+
+void Engine::cmd_minf()
+{
+	int count = getUInt();
+	if (count > (int)OC_ARRAYSIZE(m_stack))
+	{
+		runtimeError("count too large");
+		return;
+	}
+
+	float values[OC_ARRAYSIZE(m_stack)] __attribute__((aligned(8)));
+	getArgArray<Arg::SFloat>(values, count);
+	putFloat(count ? pairedMin(values, count) : 0.f);
+}
+
+void Engine::cmd_maxf()
+{
+	int count = getUInt();
+	if (count > (int)OC_ARRAYSIZE(m_stack))
+	{
+		runtimeError("count too large");
+		return;
+	}
+
+	float values[OC_ARRAYSIZE(m_stack)] __attribute__((aligned(8)));
+	getArgArray<Arg::SFloat>(values, count);
+	putFloat(count ? pairedMax(values, count) : 0.f);
+}
+
+void Engine::cmd_scanf()
+{
+	int count = getUInt();
+	if (count > (int)OC_ARRAYSIZE(m_stack))
+	{
+		runtimeError("count too large");
+		return;
+	}
+
+	float values[OC_ARRAYSIZE(m_stack)];
+	getArgArray<Arg::SFloat>(values, count);
+
+	// One after the other, like repeated addf. The total ends up on top.
+	float sum = 0.f;
+	for (int i = 0; i < count; ++i)
+	{
+		sum += values[i];
+		putFloat(sum);
+	}
+}
+
 void Engine::cmd_inspect()
 {
-	int num_ints = getUInt();
-	int num_floats = getUInt();
+	auto [num_ints, num_floats] = getArgs<Arg::UInt, Arg::UInt>();
 
 	uint32_t ident = makeIdent("INSQ");
 	int size = sizeof(int)
 		+ num_ints * sizeof(int)
 		+ num_floats * sizeof(float);
 
-	hostWrite(&ident, sizeof(ident));
-	hostWrite(&size, sizeof(size));
+	hostWriteMsgHeader(ident, size);
 
 	hostWrite(&num_ints, sizeof(num_ints));
 	for (int i = 0; i < num_ints; ++i)
@@ -506,7 +701,7 @@ void Engine::cmd_inspect()
 		hostWrite(&v, sizeof(float));
 	}
 
-	hostFlush();
+	hostEndMsg();
 }
 
 void Engine::cmd_print()
@@ -0,0 +1,296 @@
+#include "engine.h"
+
+#include <cstdlib>
+#include <cstring>
+
+// Values a run of pure commands has left so far. They go on top of whatever
+// is on the stack when the run is reached, and the run never looks below
+// them.
+struct Engine::FoldStack
+{
+	StackValue values[OC_ARRAYSIZE(Engine::m_stack)];
+	int size;
+	// Most values there were at once
+	int peak;
+};
+
+int Engine::parseProgram(char *text, Instr *program)
+{
+	int count = 0;
+	char *p = text;
+	while (*p)
+	{
+		// Skip whitespace
+		if (*p == ' ')
+		{
+			++p;
+			continue;
+		}
+
+		// Get one command, terminated so the arguments end with it
+		char *cmd_end = strchr(p, ' ');
+		char *next = cmd_end ? cmd_end + 1 : p + strlen(p);
+		if (cmd_end)
+			*cmd_end = '\0';
+
+		// Split off the argument section
+		const char *arg_sep = strchr(p, ':');
+		int name_len = arg_sep ? arg_sep - p : strlen(p);
+
+		Instr &instr = program[count++];
+		instr = {};
+		instr.kind = InstrKind_Command;
+		instr.span = 1;
+		instr.name = p;
+		instr.name_len = name_len;
+		instr.arg = arg_sep ? arg_sep : "";
+		for (const CommandInfo *ci = s_commands; ci->name; ++ci)
+		{
+			if (!strncmp(ci->name, p, name_len) && !ci->name[name_len])
+			{
+				instr.command = ci;
+				break;
+			}
+		}
+
+		p = next;
+	}
+	return count;
+}
+
+StackValue *Engine::optimizeProgram(Instr *program, int count)
+{
+	StackValue *pool = nullptr;
+	int pool_used = 0;
+	for (int i = 0; i < count;)
+	{
+		// A single command isn't worth it, it would parse its immediates
+		// here and again when it runs.
+		int end = i;
+		while (end < count && program[end].command && (program[end].command->flags & CommandFlag_Pure))
+		{
+			++end;
+		}
+
+		if (end - i >= 2)
+		{
+			// Longest run that only uses immediates and what the run itself
+			// pushed
+			FoldStack fold;
+			fold.size = 0;
+			fold.peak = 0;
+			end = i;
+			while (end < count && foldInstr(program[end], fold))
+			{
+				++end;
+			}
+
+			if (end - i >= 2)
+			{
+				if (!pool)
+				{
+					pool = (StackValue *)malloc(sizeof(StackValue) * k_fold_pool_size);
+				}
+				if (fold.size <= k_fold_pool_size - pool_used)
+				{
+					Instr &instr = program[i];
+					instr.kind = InstrKind_Fold;
+					instr.span = end - i;
+					instr.peak = fold.peak;
+					instr.values = pool + pool_used;
+					instr.value_count = fold.size;
+					memcpy(pool + pool_used, fold.values, sizeof(StackValue) * fold.size);
+					pool_used += fold.size;
+				}
+				i = end;
+				continue;
+			}
+		}
+
+		// dup and del on their own
+		if (i + 1 < count)
+		{
+			const Instr &dup = program[i];
+			const Instr &del = program[i + 1];
+			if (dup.command && dup.command->function == &Engine::cmd_dup && !*dup.arg &&
+				del.command && del.command->function == &Engine::cmd_del && !*del.arg)
+			{
+				program[i].kind = InstrKind_DupDel;
+				program[i].span = 2;
+				i += 2;
+				continue;
+			}
+		}
+
+		++i;
+	}
+	return pool;
+}
+
+// Same as prepareNextArg() for i and f immediates. Anything else can fail or
+// set up GQR2, that's left to the command.
+static bool parseImmediate(const char **text, StackValue *out)
+{
+	// Skip the ':'
+	const char *p = *text + 1;
+	char code = *p;
+	if (code != 'i' && code != 'f')
+		return false;
+	++p;
+
+	const char *end = strchr(p, ':');
+	if (!end)
+	{
+		end = p + strlen(p);
+	}
+
+	char *got_end;
+	if (code == 'i')
+	{
+		*out = StackValue{ .type = StackValueType_Int, .i = (int)strtol(p, &got_end, 0) };
+	}
+	else
+	{
+		*out = StackValue{ .type = StackValueType_Float, .f = strtof(p, &got_end) };
+	}
+
+	if (got_end != end)
+		return false;
+
+	*text = end;
+	return true;
+}
+
+bool Engine::foldInstr(const Instr &instr, FoldStack &fold)
+{
+	if (!instr.command || !(instr.command->flags & CommandFlag_Pure))
+		return false;
+
+	// Arguments come from the text first, then off the top of the stack,
+	// like prepareNextArg(). Past the values of the run they would depend
+	// on the stack or be default zeroes, so the run ends there. Nothing
+	// changes until the command is known to fold.
+	const char *text = instr.arg;
+	int popped = 0;
+	auto next = [&](StackValue *out) {
+		if (*text)
+			return parseImmediate(&text, out);
+		if (popped >= fold.size)
+			return false;
+		*out = fold.values[fold.size - 1 - popped++];
+		return true;
+	};
+
+	// What the command pushes, the first result repeat times over
+	StackValue results[2];
+	int result_count = 0;
+	int repeat = 1;
+
+	StackValue a, b;
+	void (Engine::*function)() = instr.command->function;
+	if (function == &Engine::cmd_int)
+	{
+		if (!next(&a))
+			return false;
+		results[result_count++] = StackValue{ .type = StackValueType_Int, .i = convertArg<Arg::SInt>(a) };
+	}
+	else if (function == &Engine::cmd_float)
+	{
+		if (!next(&a))
+			return false;
+		results[result_count++] = StackValue{ .type = StackValueType_Float, .f = convertArg<Arg::SFloat>(a) };
+	}
+	else if (function == &Engine::cmd_dup)
+	{
+		if (!next(&a))
+			return false;
+		results[result_count++] = a;
+		results[result_count++] = a;
+	}
+	else if (function == &Engine::cmd_stack)
+	{
+		if (!next(&a))
+			return false;
+		results[result_count++] = a;
+	}
+	else if (function == &Engine::cmd_rpt)
+	{
+		if (!next(&a) || !next(&b))
+			return false;
+		results[result_count++] = b;
+		repeat = convertArg<Arg::UInt>(a);
+	}
+	else if (function == &Engine::cmd_del)
+	{
+		if (!next(&a))
+			return false;
+	}
+	else if (function == &Engine::cmd_drop)
+	{
+		if (!next(&a))
+			return false;
+		int count = convertArg<Arg::UInt>(a);
+		for (int i = 0; i < count; ++i)
+		{
+			if (!next(&b))
+				return false;
+		}
+	}
+	else if (function == &Engine::cmd_addi || function == &Engine::cmd_muli)
+	{
+		if (!next(&a) || !next(&b))
+			return false;
+		// Wraps around like the commands
+		uint32_t lhs = (uint32_t)convertArg<Arg::SInt>(a);
+		uint32_t rhs = (uint32_t)convertArg<Arg::SInt>(b);
+		int v = function == &Engine::cmd_addi ? (int)(lhs + rhs) : (int)(lhs * rhs);
+		results[result_count++] = StackValue{ .type = StackValueType_Int, .i = v };
+	}
+	else if (function == &Engine::cmd_addf || function == &Engine::cmd_mulf)
+	{
+		if (!next(&a) || !next(&b))
+			return false;
+		float lhs = convertArg<Arg::SFloat>(a);
+		float rhs = convertArg<Arg::SFloat>(b);
+		float v = function == &Engine::cmd_addf ? lhs + rhs : lhs * rhs;
+		results[result_count++] = StackValue{ .type = StackValueType_Float, .f = v };
+	}
+	else if (function == &Engine::cmd_sumi)
+	{
+		if (!next(&a))
+			return false;
+		int count = convertArg<Arg::UInt>(a);
+		if (count > (int)OC_ARRAYSIZE(m_stack))
+			return false;
+
+		uint32_t sum = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			if (!next(&b))
+				return false;
+			sum += (uint32_t)convertArg<Arg::SInt>(b);
+		}
+		results[result_count++] = StackValue{ .type = StackValueType_Int, .i = (int)sum };
+	}
+	else
+	{
+		return false;
+	}
+
+	// Would overflow whatever the stack holds, the command reports that.
+	int size = fold.size - popped;
+	if (result_count * repeat > (int)OC_ARRAYSIZE(fold.values) - size)
+		return false;
+
+	for (int r = 0; r < repeat; ++r)
+	{
+		for (int i = 0; i < result_count; ++i)
+		{
+			fold.values[size++] = results[i];
+		}
+	}
+	fold.size = size;
+	if (fold.peak < size)
+		fold.peak = size;
+	return true;
+}
@@ -1,4 +1,20 @@
 #include "host.h"
+#include "util.h"
+
+#include <cstring>
+
+#if !OC_MULTI_REQUEST
+HostMsgContext g_host_msg = {};
+#endif
+
+void hostCheckReply(uint32_t ident, const HostMsgContext &msg)
+{
+	const HostMsgContext *current = hostMsg();
+	if (msg.v2 != current->v2 || msg.request_id != current->request_id)
+	{
+		OC_ERR("reply %08x for request %u during %u", ident, msg.request_id, current->request_id);
+	}
+}
 
 #if !OC_IDENT_INLINE
 uint32_t makeIdent(const char *text)
@@ -1,13 +1,19 @@
 #pragma once
 
+#include "profile.h"
+
 #include <cstdint>
 #include <cstdlib>
 #include <cstdio>
 
-#if OC_OGC_GECKO
+#if OC_HOST_NATIVE
+#include "host_native.h"
+#elif OC_OGC_GECKO
 // libogc *needs* this to have some of the above includes, so has to be at the
 // bottom.
 #include <ogc/usbgecko.h>
+#elif OC_IO_THREAD
+#include "io.h"
 #else
 #include "ug.h"
 #endif
@@ -27,27 +33,98 @@ uint32_t makeIdent(const char *text);
 
 constexpr int kGeckoExiChan = 1;
 
+// Messages are ident, len, data. A set top bit in len marks a v2 header,
+// which has the request id and flags between len and data. The host asks
+// which version we speak with VERQ; replies always use the version and
+// request id of the request being served.
+constexpr uint32_t kHostProtocolVersion = 2;
+constexpr uint32_t kHostMsgV2 = 0x80000000;
+
+enum HostMsgFlag
+{
+	HostMsgFlag_Final = 1 << 0, // last message of a request
+};
+
+struct HostMsgContext
+{
+	bool v2;
+	uint32_t request_id;
+	uint32_t flags;
+};
+
+#if OC_MULTI_REQUEST
+// In dispatch.cpp, every request thread has its own header and replies are
+// handed to it by the dispatcher.
+HostMsgContext *hostMsg();
+void hostReadReply(uint32_t *ident, uint32_t *len, void **data);
+void hostLockWrite();
+void hostUnlockWrite();
+#else
+// Header of the request being served
+extern HostMsgContext g_host_msg;
+
+inline HostMsgContext *hostMsg()
+{
+	return &g_host_msg;
+}
+
+inline void hostLockWrite()
+{
+}
+
+inline void hostUnlockWrite()
+{
+}
+#endif
+
+// Makes sure a reply belongs to the request being served.
+void hostCheckReply(uint32_t ident, const HostMsgContext &msg);
+
 inline void hostWrite(const void *data, int size)
 {
-#if OC_OGC_GECKO
+#if OC_PROFILE
+	uint32_t profile_start = profileTicks();
+#endif
+#if OC_HOST_NATIVE
+	hostGetBackend()->write(data, size);
+#elif OC_OGC_GECKO
 	usb_sendbuffer_safe(kGeckoExiChan, data, size);
+#elif OC_IO_THREAD
+	ioWrite(data, size);
 #else
 	ugSendBlocking(kGeckoExiChan, data, size);
 #endif
+#if OC_PROFILE
+	g_profile.write_ticks += (uint32_t)(profileTicks() - profile_start);
+#endif
 }
 
 inline void hostRead(void *data, int size)
 {
-#if OC_OGC_GECKO
+#if OC_PROFILE
+	uint32_t profile_start = profileTicks();
+#endif
+#if OC_HOST_NATIVE
+	hostGetBackend()->read(data, size);
+#elif OC_OGC_GECKO
 	usb_recvbuffer_safe(kGeckoExiChan, data, size);
+#elif OC_IO_THREAD
+	ioRead(data, size);
 #else
 	ugRecvBlocking(kGeckoExiChan, data, size);
 #endif
+#if OC_PROFILE
+	g_profile.read_ticks += (uint32_t)(profileTicks() - profile_start);
+#endif
 }
 
 inline void hostFlush()
 {
-#if !OC_OGC_GECKO
+#if OC_HOST_NATIVE
+	hostGetBackend()->flush();
+#elif OC_IO_THREAD
+	ioFlush();
+#elif !OC_OGC_GECKO
 	ugFlush(kGeckoExiChan);
 #endif
 }
@@ -61,8 +138,12 @@ inline bool hostTryRead(void *data, int size)
 	bool first = true;
 	while (size_left > 0)
 	{
-#if OC_OGC_GECKO
+#if OC_HOST_NATIVE
+		int got = hostGetBackend()->recv(data_left, size_left);
+#elif OC_OGC_GECKO
 		int got = usb_recvbuffer(kGeckoExiChan, data_left, size_left);
+#elif OC_IO_THREAD
+		int got = ioRecv(data_left, size_left);
 #else
 		int got = ugRecv(kGeckoExiChan, data_left, size_left);
 #endif
@@ -81,45 +162,94 @@ inline bool hostTryRead(void *data, int size)
 	return true;
 }
 
-inline void hostWriteMsg(uint32_t ident, uint32_t len, const void *data)
+// Starts a message, which has to be finished with hostEndMsg() so messages
+// of different requests don't interleave.
+inline void hostWriteMsgHeader(uint32_t ident, uint32_t len, uint32_t flags = 0)
 {
+	hostLockWrite();
+
+	const HostMsgContext *msg = hostMsg();
 	hostWrite(&ident, sizeof(uint32_t));
-	hostWrite(&len, sizeof(uint32_t));
-	if (len)
+	if (msg->v2)
 	{
-		hostWrite(data, len);
+		uint32_t header[3] = { len | kHostMsgV2, msg->request_id, flags };
+		hostWrite(header, sizeof(header));
 	}
+	else
+	{
+		hostWrite(&len, sizeof(uint32_t));
+	}
+}
+
+inline void hostEndMsg()
+{
 	hostFlush();
+	hostUnlockWrite();
 }
 
-inline bool hostTryReadMsg(uint32_t *ident, uint32_t *len, void **data)
+inline void hostWriteMsg(uint32_t ident, uint32_t len, const void *data, uint32_t flags = 0)
 {
-	// Try to get the ident
-	if (!hostTryRead(ident, sizeof(uint32_t)))
+	hostWriteMsgHeader(ident, len, flags);
+	if (len)
 	{
-		// No message available
-		return false;
+		hostWrite(data, len);
 	}
+	hostEndMsg();
+}
 
-	// Got the ident, block for the rest.
+// Everything after the ident
+inline void hostReadMsgRest(uint32_t *len, void **data, HostMsgContext *msg)
+{
 	hostRead(len, sizeof(uint32_t));
+	*msg = {};
+	if (*len & kHostMsgV2)
+	{
+		uint32_t header[2];
+		hostRead(header, sizeof(header));
+		*len &= ~kHostMsgV2;
+		msg->v2 = true;
+		msg->request_id = header[0];
+		msg->flags = header[1];
+	}
+
 	*data = malloc(*len ? *len : 1);
 	if (*len)
 	{
 		hostRead(*data, *len);
 	}
-	return true;
 }
 
-inline void hostReadMsg(uint32_t *ident, uint32_t *len, void **data)
+// Reads a new request, its header goes to msg.
+inline bool hostTryReadMsg(uint32_t *ident, uint32_t *len, void **data, HostMsgContext *msg)
 {
-	hostRead(ident, sizeof(uint32_t));
-	hostRead(len, sizeof(uint32_t));
-	*data = malloc(*len ? *len : 1);
-	if (*len)
+	// Try to get the ident
+	if (!hostTryRead(ident, sizeof(uint32_t)))
 	{
-		hostRead(*data, *len);
+		// No message available
+		return false;
 	}
+
+	// Got the ident, block for the rest.
+	hostReadMsgRest(len, data, msg);
+	return true;
+}
+
+inline void hostReadMsg(uint32_t *ident, uint32_t *len, void **data, HostMsgContext *msg)
+{
+	hostRead(ident, sizeof(uint32_t));
+	hostReadMsgRest(len, data, msg);
+}
+
+// Reads a reply to the request being served.
+inline void hostReadMsg(uint32_t *ident, uint32_t *len, void **data)
+{
+#if OC_MULTI_REQUEST
+	hostReadReply(ident, len, data);
+#else
+	HostMsgContext msg;
+	hostReadMsg(ident, len, data, &msg);
+	hostCheckReply(*ident, msg);
+#endif
 }
 
 #define OC_HOST_TEXTMSG(ident, fmt, ...) \
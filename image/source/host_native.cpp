@@ -0,0 +1,126 @@
+#if OC_HOST_NATIVE
+
+#include "host.h"
+#include "util.h"
+
+#include <cstdlib>
+#include <cstring>
+
+static thread_local HostBackend *s_backend = nullptr;
+
+void hostSetBackend(HostBackend *backend)
+{
+	s_backend = backend;
+}
+
+HostBackend *hostGetBackend()
+{
+	if (!s_backend)
+	{
+		fprintf(stderr, "host: no backend installed\n");
+		abort();
+	}
+	return s_backend;
+}
+
+void hostHang()
+{
+	if (s_backend)
+		s_backend->hang();
+	abort();
+}
+
+void HostBackend::hang()
+{
+	fprintf(stderr, "host: engine hung\n");
+	abort();
+}
+
+static void growBuffer(uint8_t **buffer, int *capacity, int needed)
+{
+	if (needed <= *capacity)
+		return;
+
+	int new_capacity = *capacity ? *capacity : 256;
+	while (new_capacity < needed)
+		new_capacity *= 2;
+	*buffer = (uint8_t *)realloc(*buffer, new_capacity);
+	*capacity = new_capacity;
+}
+
+HostMessageBackend::~HostMessageBackend()
+{
+	free(m_out);
+	free(m_in);
+}
+
+void HostMessageBackend::write(const void *data, int size)
+{
+	growBuffer(&m_out, &m_out_capacity, m_out_size + size);
+	memcpy(m_out + m_out_size, data, size);
+	m_out_size += size;
+
+	// Dispatch everything that is complete by now. Like the frontend, we go
+	// by the size in the header.
+	int seek = 0;
+	while (m_out_size - seek >= 8)
+	{
+		uint32_t ident, len;
+		memcpy(&ident, m_out + seek, sizeof(uint32_t));
+		memcpy(&len, m_out + seek + 4, sizeof(uint32_t));
+		if ((uint32_t)(m_out_size - seek - 8) < len)
+			break;
+
+		onMessage(ident, len, m_out + seek + 8);
+		seek += 8 + len;
+	}
+
+	memmove(m_out, m_out + seek, m_out_size - seek);
+	m_out_size -= seek;
+}
+
+void HostMessageBackend::read(void *data, int size)
+{
+	if (m_in_size - m_in_seek < size)
+	{
+		// Nothing will ever arrive, this would block forever.
+		hang();
+	}
+
+	memcpy(data, m_in + m_in_seek, size);
+	m_in_seek += size;
+}
+
+int HostMessageBackend::recv(void *data, int size)
+{
+	int got = m_in_size - m_in_seek;
+	if (got > size)
+		got = size;
+	memcpy(data, m_in + m_in_seek, got);
+	m_in_seek += got;
+	return got;
+}
+
+void HostMessageBackend::reply(uint32_t ident, uint32_t len, const void *data)
+{
+	// Compact what was consumed already
+	memmove(m_in, m_in + m_in_seek, m_in_size - m_in_seek);
+	m_in_size -= m_in_seek;
+	m_in_seek = 0;
+
+	growBuffer(&m_in, &m_in_capacity, m_in_size + 8 + len);
+	memcpy(m_in + m_in_size, &ident, sizeof(uint32_t));
+	memcpy(m_in + m_in_size + 4, &len, sizeof(uint32_t));
+	if (len)
+		memcpy(m_in + m_in_size + 8, data, len);
+	m_in_size += 8 + len;
+}
+
+void HostMessageBackend::reset()
+{
+	m_out_size = 0;
+	m_in_size = 0;
+	m_in_seek = 0;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+
+// Host transport for native builds, standing in for the USB Gecko. Data is
+// exchanged in host byte order, so on x86 the message headers and any
+// numbers in them come out little-endian.
+class HostBackend
+{
+public:
+	virtual ~HostBackend() = default;
+
+	// Blocking transfers of exactly size bytes.
+	virtual void write(const void *data, int size) = 0;
+	virtual void read(void *data, int size) = 0;
+
+	// Non-blocking receive, returns how many bytes were available.
+	virtual int recv(void *data, int size) = 0;
+
+	virtual void flush() {}
+
+	// Called on fatal errors in place of hanging. The default aborts, tests
+	// may throw instead.
+	[[noreturn]] virtual void hang();
+};
+
+// Message-level backend: reassembles everything the engine writes into
+// messages and serves queued replies to its reads.
+class HostMessageBackend : public HostBackend
+{
+public:
+	~HostMessageBackend() override;
+
+	void write(const void *data, int size) override;
+	void read(void *data, int size) override;
+	int recv(void *data, int size) override;
+
+	// Queue a message for the engine to read.
+	void reply(uint32_t ident, uint32_t len, const void *data);
+	// Drop any partial output and pending replies.
+	void reset();
+
+protected:
+	// Called for each complete message from the engine. data is only valid
+	// during the call.
+	virtual void onMessage(uint32_t ident, uint32_t len, const void *data) = 0;
+
+private:
+	uint8_t *m_out = nullptr;
+	int m_out_size = 0;
+	int m_out_capacity = 0;
+
+	uint8_t *m_in = nullptr;
+	int m_in_seek = 0;
+	int m_in_size = 0;
+	int m_in_capacity = 0;
+};
+
+// Installs the backend used by all host functions on the calling thread.
+void hostSetBackend(HostBackend *backend);
+HostBackend *hostGetBackend();
@@ -0,0 +1,245 @@
+#if OC_IO_THREAD
+
+#include "io.h"
+#include "host.h"
+#include "spsc.h"
+#include "ug.h"
+#include "util.h"
+
+#include <ogc/lwp.h>
+#include <ogc/system.h>
+
+#include <cstring>
+#include <ctime>
+
+// Above the engine and the request threads, so the I/O thread runs as soon
+// as it's woken up. It only ever blocks in LWP_ThreadSleep() and nanosleep().
+constexpr uint32_t kIoPriority = 80;
+constexpr uint32_t kIoStackSize = 0x4000;
+
+// How often the I/O thread looks for input and sends pending output while
+// the engine is busy. This is also what gets ERRQ out while OC_HANG() spins.
+constexpr long kIoPollNs = 1000 * 1000;
+// How often it looks while the engine waits on the host instead. Sleeping in
+// between leaves the CPU to request threads that still have work.
+constexpr long kIoWaitPollNs = 50 * 1000;
+
+constexpr uint32_t kIoRingSize = 0x4000;
+// Start sending before the engine has to wait for room.
+constexpr uint32_t kIoOutHighWater = kIoRingSize / 2;
+
+static SpscRing<kIoRingSize> s_out;
+static SpscRing<kIoRingSize> s_in;
+
+static uint8_t s_io_stack[kIoStackSize] __attribute__((aligned(32)));
+static lwp_t s_io_thread;
+static lwpq_t s_io_wake;
+static lwpq_t s_engine_wake;
+static syswd_t s_io_alarm;
+
+static volatile bool s_engine_waiting;
+static volatile bool s_flush_pending;
+
+// Incoming messages are split up so only the header is polled for byte by
+// byte, bodies are known to be on their way and go by DMA.
+static uint8_t s_in_header[16];
+static uint32_t s_in_header_size;
+static uint32_t s_in_header_needed = 8;
+static uint32_t s_in_body_left;
+static uint8_t s_in_bounce[0x400] __attribute__((aligned(32)));
+
+static bool ioPumpOut()
+{
+	bool progress = false;
+	while (true)
+	{
+		uint32_t size;
+		const uint8_t *data = s_out.peek(&size);
+		if (!size)
+			break;
+
+		ugSendBlocking(kGeckoExiChan, data, size);
+		s_out.consume(size);
+		progress = true;
+	}
+
+	if (s_flush_pending)
+	{
+		s_flush_pending = false;
+		ugFlush(kGeckoExiChan);
+	}
+	return progress;
+}
+
+static bool ioPumpIn()
+{
+	if (!s_in_body_left)
+	{
+		bool progress = false;
+		if (s_in_header_size < s_in_header_needed)
+		{
+			// Header, whatever part of it is there
+			int got = ugRecv(kGeckoExiChan, s_in_header + s_in_header_size, s_in_header_needed - s_in_header_size);
+			if (got <= 0)
+				return false;
+			s_in_header_size += got;
+			progress = true;
+
+			if (s_in_header_size == 8)
+			{
+				uint32_t len;
+				memcpy(&len, s_in_header + 4, sizeof(len));
+				if (len & kHostMsgV2)
+					s_in_header_needed = 16;
+			}
+			if (s_in_header_size < s_in_header_needed)
+				return true;
+		}
+
+		// Wait for the engine to make room if it has to.
+		if (s_in.writable() < s_in_header_size)
+			return progress;
+
+		uint32_t len;
+		memcpy(&len, s_in_header + 4, sizeof(len));
+		s_in.write(s_in_header, s_in_header_size);
+		s_in_body_left = len & ~kHostMsgV2;
+		s_in_header_size = 0;
+		s_in_header_needed = 8;
+		return true;
+	}
+
+	uint32_t size = s_in.writable();
+	if (size > s_in_body_left)
+		size = s_in_body_left;
+	if (size > sizeof(s_in_bounce))
+		size = sizeof(s_in_bounce);
+	if (!size)
+		return false;
+
+	ugRecvBlocking(kGeckoExiChan, s_in_bounce, size);
+	s_in.write(s_in_bounce, size);
+	s_in_body_left -= size;
+	return true;
+}
+
+static void *ioThread(void *arg)
+{
+	while (true)
+	{
+		// Input first, the engine might be waiting on it.
+		while (ioPumpIn() | ioPumpOut())
+		{
+		}
+
+		// Whatever the engine waited for might be there now, it checks.
+		// Until it stops waiting, the reply is picked up on the next short
+		// poll rather than on the alarm.
+		if (s_engine_waiting)
+		{
+			LWP_ThreadBroadcast(s_engine_wake);
+			timespec wait = { 0, kIoWaitPollNs };
+			nanosleep(&wait, nullptr);
+			continue;
+		}
+
+		LWP_ThreadSleep(s_io_wake);
+	}
+	return nullptr;
+}
+
+OC_INIT_FUNCTION()
+{
+	LWP_InitQueue(&s_io_wake);
+	LWP_InitQueue(&s_engine_wake);
+	LWP_CreateThread(&s_io_thread, ioThread, nullptr, s_io_stack, kIoStackSize, kIoPriority);
+
+	SYS_CreateAlarm(&s_io_alarm);
+	timespec interval = { 0, kIoPollNs };
+	SYS_SetPeriodicAlarm(
+		s_io_alarm,
+		&interval,
+		&interval,
+		[](syswd_t alarm, void *user)
+		{
+			LWP_ThreadSignal(s_io_wake);
+		},
+		nullptr
+	);
+}
+
+// Wakes the I/O thread, which runs right away, then sleeps if that wasn't
+// enough. A wakeup that comes in before we sleep is lost, but the I/O thread
+// keeps polling and waking us every kIoWaitPollNs while we wait.
+template <typename Ready>
+static void ioWait(Ready ready)
+{
+	while (!ready())
+	{
+		s_engine_waiting = true;
+		LWP_ThreadSignal(s_io_wake);
+		if (ready())
+			break;
+		LWP_ThreadSleep(s_engine_wake);
+	}
+	s_engine_waiting = false;
+}
+
+void ioWrite(const void *data, int size)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	while (size > 0)
+	{
+		uint32_t done = s_out.write(p, size);
+		p += done;
+		size -= done;
+		if (size)
+		{
+			ioWait([] { return s_out.writable() > 0; });
+		}
+	}
+
+	if (s_out.readable() >= kIoOutHighWater)
+	{
+		LWP_ThreadSignal(s_io_wake);
+	}
+}
+
+void ioRead(void *data, int size)
+{
+	// Anything still queued might be what the host answers to.
+	if (s_out.readable())
+	{
+		LWP_ThreadSignal(s_io_wake);
+	}
+
+	uint8_t *p = (uint8_t *)data;
+	while (size > 0)
+	{
+		uint32_t got = s_in.read(p, size);
+		p += got;
+		size -= got;
+		if (size)
+		{
+			ioWait([] { return s_in.readable() > 0; });
+		}
+	}
+}
+
+int ioRecv(void *data, int size)
+{
+	int got = s_in.read(data, size);
+	if (!got)
+	{
+		// Have a look now rather than on the next poll.
+		LWP_ThreadSignal(s_io_wake);
+	}
+	return got;
+}
+
+void ioFlush()
+{
+	s_flush_pending = true;
+}
+
+#endif
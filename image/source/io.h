@@ -0,0 +1,24 @@
+#pragma once
+
+// Optional I/O thread that owns the USB Gecko channel, enabled with
+// OC_IO_THREAD. The engine only copies to and from rings in memory: output
+// goes out in batches while the engine waits or every poll interval, and
+// input is fetched ahead so it's there when the engine asks for it. Without
+// it the engine drives every EXI transfer itself (ug.h).
+//
+// The rings have one writer and one reader each, so only one thread may
+// write or read at a time. With several requests the write lock in host.h
+// sees to that, and only the dispatcher reads.
+#if OC_IO_THREAD
+
+// Blocking, like ugSendBlocking()/ugRecvBlocking().
+void ioWrite(const void *data, int size);
+void ioRead(void *data, int size);
+
+// Non-blocking, returns how many bytes were already fetched.
+int ioRecv(void *data, int size);
+
+// Asks for everything written so far to be sent, doesn't wait for it.
+void ioFlush();
+
+#endif
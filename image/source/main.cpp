@@ -2,6 +2,8 @@
 #include "sleep.h"
 #include "engine.h"
 #include "host.h"
+#include "profile.h"
+#include "dispatch.h"
 
 #include <cstdio>
 #include <cstdint>
@@ -22,22 +24,38 @@ int main(int argc, char **argv)
 	// Signal ready for requests
 	hostWriteMsg(makeIdent("RDYQ"), 0, nullptr);
 
+#if OC_MULTI_REQUEST
+	dispatchRun();
+#endif
+
 	while (true)
 	{
 		// Wait for input
 		uint32_t request_ident, request_len;
 		void *request_data;
+		HostMsgContext request_msg;
 #define OC_SLEEP_IDLE 0
 #if OC_SLEEP_IDLE
-		while (!hostTryReadMsg(&request_ident, &request_len, &request_data))
+		while (!hostTryReadMsg(&request_ident, &request_len, &request_data, &request_msg))
 		{
 			// Sleep to back off of CPU time while idle
 			sleepMs(10);
 		}
 #else
-		hostReadMsg(&request_ident, &request_len, &request_data);
+		hostReadMsg(&request_ident, &request_len, &request_data, &request_msg);
 #endif
 
+		if (request_ident == makeIdent("VERQ"))
+		{
+			// Always answered in v1, the host picks the version and how many
+			// requests to send at once from here.
+			free(request_data);
+			*hostMsg() = {};
+			uint32_t version[2] = { kHostProtocolVersion, 1 };
+			hostWriteMsg(makeIdent("VERA"), sizeof(version), version);
+			continue;
+		}
+
 		if (request_ident != makeIdent("REQQ"))
 		{
 			//const char *msg = "invalid request msg\n";
@@ -45,6 +63,11 @@ int main(int argc, char **argv)
 			continue;
 		}
 
+		*hostMsg() = request_msg;
+#if OC_PROFILE
+		profileBegin();
+#endif
+
 		// Run the request
 		// Attach null terminator
 		char *request_text = (char *)request_data;
@@ -54,7 +77,10 @@ int main(int argc, char **argv)
 		free(request_text);
 		
 		// Respond
-		hostWriteMsg(makeIdent("REQA"), strlen(response_data), response_data);
+#if OC_PROFILE
+		profileSend();
+#endif
+		hostWriteMsg(makeIdent("REQA"), strlen(response_data), response_data, HostMsgFlag_Final);
 		free(response_data);
 	}
 }
\ No newline at end of file
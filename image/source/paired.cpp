@@ -0,0 +1,102 @@
+#include "paired.h"
+
+// What ps_sel on the difference does per lane
+static inline float pickMin(float m, float v)
+{
+	float d = v - m;
+	return d >= 0.f ? m : v;
+}
+
+static inline float pickMax(float m, float v)
+{
+	float d = v - m;
+	return d >= 0.f ? v : m;
+}
+
+void pairedAdd(float *out, const float *a, const float *b, int count)
+{
+	for (int i = 0; i < count; ++i)
+		out[i] = a[i] + b[i];
+}
+
+void pairedMul(float *out, const float *a, const float *b, int count)
+{
+	for (int i = 0; i < count; ++i)
+		out[i] = a[i] * b[i];
+}
+
+void pairedScale(float *out, const float *a, float s, int count)
+{
+	for (int i = 0; i < count; ++i)
+		out[i] = a[i] * s;
+}
+
+float pairedSum(const float *a, int count)
+{
+	float lane0 = 0.f;
+	float lane1 = 0.f;
+	int i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		lane0 += a[i];
+		lane1 += a[i + 1];
+	}
+
+	float sum = lane0 + lane1;
+	if (i < count)
+		sum += a[i];
+	return sum;
+}
+
+float pairedDot(const float *a, const float *b, int count)
+{
+	float lane0 = 0.f;
+	float lane1 = 0.f;
+	int i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		// No fused multiply-add, ps_mul and ps_add round separately
+		float p0 = a[i] * b[i];
+		float p1 = a[i + 1] * b[i + 1];
+		lane0 += p0;
+		lane1 += p1;
+	}
+
+	float sum = lane0 + lane1;
+	if (i < count)
+	{
+		float p = a[i] * b[i];
+		sum += p;
+	}
+	return sum;
+}
+
+float pairedMin(const float *a, int count)
+{
+	float lanes[2] = { a[0], a[0] };
+	for (int i = 0; i + 2 <= count; i += 2)
+	{
+		lanes[0] = pickMin(lanes[0], a[i]);
+		lanes[1] = pickMin(lanes[1], a[i + 1]);
+	}
+
+	float m = pickMin(lanes[0], lanes[1]);
+	if (count & 1)
+		m = pickMin(m, a[count - 1]);
+	return m;
+}
+
+float pairedMax(const float *a, int count)
+{
+	float lanes[2] = { a[0], a[0] };
+	for (int i = 0; i + 2 <= count; i += 2)
+	{
+		lanes[0] = pickMax(lanes[0], a[i]);
+		lanes[1] = pickMax(lanes[1], a[i + 1]);
+	}
+
+	float m = pickMax(lanes[0], lanes[1]);
+	if (count & 1)
+		m = pickMax(m, a[count - 1]);
+	return m;
+}
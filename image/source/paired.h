@@ -0,0 +1,22 @@
+#pragma once
+
+// Float kernels that work on two lanes at a time, the way paired singles
+// would on the console. Arrays have to be 8-byte aligned, an odd last
+// element is done on its own. This is plain C for now, in the order a
+// paired-single version has to keep so results round the same way.
+//
+// Elementwise kernels may write over either input.
+
+void pairedAdd(float *out, const float *a, const float *b, int count);
+void pairedMul(float *out, const float *a, const float *b, int count);
+void pairedScale(float *out, const float *a, float s, int count);
+
+// Each lane sums separately, the lanes are added up at the end.
+float pairedSum(const float *a, int count);
+float pairedDot(const float *a, const float *b, int count);
+
+// Same per lane, with ps_sel on the difference: a value replaces the
+// current one if the difference isn't >= 0, so NaNs behave like on the
+// console. count has to be at least one.
+float pairedMin(const float *a, int count);
+float pairedMax(const float *a, int count);
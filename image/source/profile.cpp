@@ -0,0 +1,95 @@
+#if OC_PROFILE
+
+#include "profile.h"
+#include "host.h"
+#include "util.h"
+
+#include <cstring>
+
+// PERQ layout, big-endian on the console:
+//   ProfileHeader, then count * ProfileEntry
+struct ProfileHeader
+{
+	uint64_t run_ticks;
+	uint64_t read_ticks;
+	uint64_t write_ticks;
+	uint32_t ticks_per_second;
+	uint32_t count;
+};
+
+struct ProfileEntry
+{
+	uint64_t ticks;
+	uint64_t host_ticks;
+	uint32_t calls;
+	char name[12];
+};
+
+static_assert(sizeof(ProfileHeader) == 0x20);
+static_assert(sizeof(ProfileEntry) == 0x20);
+
+// One per command, more than we have.
+constexpr int kProfileMaxEntries = 32;
+
+ProfileCounters g_profile;
+
+static uint32_t s_begin_ticks;
+static const char *s_names[kProfileMaxEntries];
+static ProfileEntry s_entries[kProfileMaxEntries];
+static int s_entry_count;
+
+void profileBegin()
+{
+	g_profile = {};
+	s_entry_count = 0;
+	s_begin_ticks = profileTicks();
+}
+
+void profileCommand(const char *name, uint32_t ticks, uint64_t host_ticks)
+{
+	// Names come from the command table, so the pointer is enough.
+	int i = 0;
+	while (i < s_entry_count && s_names[i] != name)
+		++i;
+
+	if (i == s_entry_count)
+	{
+		if (s_entry_count >= (int)OC_ARRAYSIZE(s_entries))
+			return;
+		++s_entry_count;
+
+		s_names[i] = name;
+		s_entries[i] = {};
+		strncpy(s_entries[i].name, name, sizeof(s_entries[i].name));
+	}
+
+	ProfileEntry &entry = s_entries[i];
+	entry.ticks += ticks;
+	entry.host_ticks += host_ticks;
+	++entry.calls;
+}
+
+void profileSend()
+{
+	uint32_t run_ticks = profileTicks() - s_begin_ticks;
+
+	ProfileHeader header = {
+		.run_ticks = run_ticks,
+		.read_ticks = g_profile.read_ticks,
+		.write_ticks = g_profile.write_ticks,
+		.ticks_per_second = kProfileTicksPerSecond,
+		.count = (uint32_t)s_entry_count,
+	};
+
+	uint32_t ident = makeIdent("PERQ");
+	uint32_t len = sizeof(header) + s_entry_count * sizeof(ProfileEntry);
+	hostWriteMsgHeader(ident, len);
+	hostWrite(&header, sizeof(header));
+	if (s_entry_count)
+	{
+		hostWrite(s_entries, s_entry_count * sizeof(ProfileEntry));
+	}
+	hostEndMsg();
+}
+
+#endif
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+
+// Optional per-command timing, enabled with OC_PROFILE. Commands and blocking
+// host I/O are timed against the time base and the totals for a request are
+// reported in a PERQ message right before its REQA.
+#if OC_PROFILE
+
+#if OC_HOST_NATIVE
+#include <ctime>
+
+constexpr uint32_t kProfileTicksPerSecond = 1000000000;
+#else
+// Time base runs at a quarter of the 162 MHz bus clock.
+constexpr uint32_t kProfileTicksPerSecond = 40500000;
+#endif
+
+// Only the low word, callers take differences.
+inline uint32_t profileTicks()
+{
+#if OC_HOST_NATIVE
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000000000ull + ts.tv_nsec);
+#else
+	uint32_t tb;
+	asm volatile("mftb %0" : "=r"(tb));
+	return tb;
+#endif
+}
+
+struct ProfileCounters
+{
+	uint64_t read_ticks;
+	uint64_t write_ticks;
+};
+
+extern ProfileCounters g_profile;
+
+inline uint64_t profileHostTicks()
+{
+	return g_profile.read_ticks + g_profile.write_ticks;
+}
+
+void profileBegin();
+void profileCommand(const char *name, uint32_t ticks, uint64_t host_ticks);
+void profileSend();
+
+#endif
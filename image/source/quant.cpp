@@ -0,0 +1,3 @@
+#include "quant.h"
+
+uint32_t g_quant_gqr2;
@@ -2,8 +2,9 @@
 
 #include <cstdint>
 
-// We use GQR2 for all our quantization needs.
-#if !OC_QUANT_EXTERN
+// We use GQR2 for all our quantization needs. GQR3 mirrors its scale as
+// signed 16-bit, so signed paired loads don't have to reconfigure GQR2.
+#if !OC_QUANT_EXTERN && !OC_QUANT_SOFT
 
 inline void set_gqr2(uint32_t v)
 {
@@ -41,17 +42,44 @@ inline void store_gqr2(void *p, float f)
 		: [p]"b"(p), [f]"f"(f)
 	);
 }
+inline void set_gqr3(uint32_t v)
+{
+	__asm__ volatile(
+		"mtspr 915, %[v]"
+		:
+		: [v]"b"(v)
+	);
+}
+inline float load_gqr3(void *p)
+{
+	float f;
+	__asm__ volatile(
+		"psq_l %[f], 0(%[p]), 1, 3"
+		: [f]"=f"(f)
+		: [p]"b"(p)
+	);
+	return f;
+}
 
 #else
 
+// Out-of-line, either in quant.S or emulated in quant_soft.cpp.
 extern "C"
 {
 void set_gqr2(uint32_t v);
 uint32_t get_gqr2();
 float load_gqr2(void *p);
 void store_gqr2(void *p, float f);
+void set_gqr3(uint32_t v);
+float load_gqr3(void *p);
 };
 
+#if OC_QUANT_SOFT
+// How many mtspr/mfspr the emulation stood in for on this thread, for the
+// benchmarks. They cost next to nothing here but serialize on the console.
+extern "C" uint64_t quant_soft_spr_count();
+#endif
+
 #endif
 
 // ppc_750cl.pdf Table 2-20
@@ -64,26 +92,74 @@ enum
 	QuantType_Int16 = 7,
 };
 
+constexpr uint32_t kQuantScaleBits = 6;
+constexpr uint32_t kQuantScaleMask = (1 << kQuantScaleBits) - 1;
+constexpr uint32_t kQuantTypeBits = 3;
+constexpr uint32_t kQuantTypeMask = (1 << kQuantTypeBits) - 1;
+
+// Both fields for loads and stores
+constexpr uint32_t kQuantScaleFields = (kQuantScaleMask << 24) | (kQuantScaleMask << 8);
+constexpr uint32_t kQuantTypeFields = (kQuantTypeMask << 16) | (kQuantTypeMask << 0);
+
+// Software copy of GQR2 (quant.cpp). Reading it costs no mfspr, and the
+// registers are only written when a value actually changes. The registers
+// belong to the thread while the copy doesn't, so anything that might run
+// after another thread used them has to quant_load() first.
+extern uint32_t g_quant_gqr2;
+
+inline uint32_t quant_make(int type, int scale)
+{
+	scale &= kQuantScaleMask;
+	type &= kQuantTypeMask;
+	return (scale << 24) | (type << 16) | (scale << 8) | type;
+}
+
+inline uint32_t quant_signed(uint32_t gqr)
+{
+	return (gqr & kQuantScaleFields) | quant_make(QuantType_Int16, 0);
+}
+
+inline uint32_t quant_get()
+{
+	return g_quant_gqr2;
+}
+
+// Writes GQR2 and GQR3 outright.
+inline void quant_load(uint32_t gqr)
+{
+	g_quant_gqr2 = gqr;
+	set_gqr2(gqr);
+	set_gqr3(quant_signed(gqr));
+}
+
+inline void quant_set(uint32_t gqr)
+{
+	uint32_t changed = gqr ^ g_quant_gqr2;
+	if (!changed)
+		return;
+
+	g_quant_gqr2 = gqr;
+	set_gqr2(gqr);
+	if (changed & kQuantScaleFields)
+		set_gqr3(quant_signed(gqr));
+}
+
 inline void quant_set_scale(int scale)
 {
-	constexpr uint32_t scale_bits = 6;
-	constexpr uint32_t scale_mask = (1 << scale_bits) - 1;
-	scale &= scale_mask;
+	scale &= kQuantScaleMask;
 
-	uint32_t gqr = get_gqr2();
-	gqr &= ~((scale_mask << 24) | (scale_mask << 8));
+	uint32_t gqr = quant_get();
+	gqr &= ~kQuantScaleFields;
 	gqr |= ((scale << 24) | (scale << 8));
-	set_gqr2(gqr);
+	quant_set(gqr);
 }
 
 inline void quant_set_type(int type)
 {
-	constexpr uint32_t type_bits = 3;
-	constexpr uint32_t type_mask = (1 << type_bits) - 1;
-	type &= type_mask;
+	type &= kQuantTypeMask;
 
-	uint32_t gqr = get_gqr2();
-	gqr &= ~((type_mask << 16) | (type_mask << 0));
+	uint32_t gqr = quant_get();
+	gqr &= ~kQuantTypeFields;
 	gqr |= ((type << 16) | (type << 0));
-	set_gqr2(gqr);
-}
\ No newline at end of file
+	quant_set(gqr);
+}
@@ -0,0 +1,155 @@
+#if OC_QUANT_SOFT
+
+#include "quant.h"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+// Software emulation of GQR2/GQR3 and single-element psq_l/psq_st for native
+// builds, following ppc_750cl.pdf section 2.1.2.3 (and what Dolphin does).
+// Memory is big-endian like on the real thing. GQRs are per-thread context.
+
+static thread_local uint32_t s_gqr2;
+static thread_local uint32_t s_gqr3;
+static thread_local uint64_t s_spr_count;
+
+static float quant_factor(int scale)
+{
+	// 6-bit signed
+	scale &= 0x3f;
+	if (scale & 0x20)
+		scale -= 0x40;
+	return ldexpf(1.f, scale);
+}
+
+static uint32_t load_be(const uint8_t *p, int size)
+{
+	uint32_t v = 0;
+	for (int i = 0; i < size; ++i)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static void store_be(uint8_t *p, int size, uint32_t v)
+{
+	for (int i = size - 1; i >= 0; --i)
+	{
+		p[i] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+template <typename T>
+static T saturate(float f)
+{
+	if (f != f)
+		return 0;
+	if (f <= (float)std::numeric_limits<T>::min())
+		return std::numeric_limits<T>::min();
+	if (f >= (float)std::numeric_limits<T>::max())
+		return std::numeric_limits<T>::max();
+	return (T)f;
+}
+
+static float load_quant(uint32_t gqr, const void *p)
+{
+	const uint8_t *data = (const uint8_t *)p;
+	int type = (gqr >> 16) & 0x7;
+	// Dequantization scales by 2^-scale.
+	float factor = 1.f / quant_factor(gqr >> 24);
+
+	switch (type)
+	{
+	case QuantType_Float:
+	{
+		uint32_t bits = load_be(data, 4);
+		float f;
+		memcpy(&f, &bits, sizeof(f));
+		return f;
+	}
+	case QuantType_UInt8:
+		return (float)(uint8_t)load_be(data, 1) * factor;
+	case QuantType_UInt16:
+		return (float)(uint16_t)load_be(data, 2) * factor;
+	case QuantType_Int8:
+		return (float)(int8_t)load_be(data, 1) * factor;
+	case QuantType_Int16:
+		return (float)(int16_t)load_be(data, 2) * factor;
+	default:
+		// Reserved types
+		return 0.f;
+	}
+}
+
+extern "C"
+{
+
+void set_gqr2(uint32_t v)
+{
+	++s_spr_count;
+	s_gqr2 = v;
+}
+
+uint32_t get_gqr2()
+{
+	++s_spr_count;
+	return s_gqr2;
+}
+
+float load_gqr2(void *p)
+{
+	return load_quant(s_gqr2, p);
+}
+
+void store_gqr2(void *p, float f)
+{
+	uint8_t *data = (uint8_t *)p;
+	int type = s_gqr2 & 0x7;
+	float scaled = f * quant_factor(s_gqr2 >> 8);
+
+	switch (type)
+	{
+	case QuantType_Float:
+	{
+		uint32_t bits;
+		memcpy(&bits, &f, sizeof(bits));
+		store_be(data, 4, bits);
+		break;
+	}
+	case QuantType_UInt8:
+		store_be(data, 1, saturate<uint8_t>(scaled));
+		break;
+	case QuantType_UInt16:
+		store_be(data, 2, saturate<uint16_t>(scaled));
+		break;
+	case QuantType_Int8:
+		store_be(data, 1, (uint8_t)saturate<int8_t>(scaled));
+		break;
+	case QuantType_Int16:
+		store_be(data, 2, (uint16_t)saturate<int16_t>(scaled));
+		break;
+	default:
+		break;
+	}
+}
+
+void set_gqr3(uint32_t v)
+{
+	++s_spr_count;
+	s_gqr3 = v;
+}
+
+float load_gqr3(void *p)
+{
+	return load_quant(s_gqr3, p);
+}
+
+uint64_t quant_soft_spr_count()
+{
+	return s_spr_count;
+}
+
+};
+
+#endif
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+// Byte ring between exactly one producer and one consumer thread. Each side
+// only ever stores its own index, so neither needs a lock. Indices run freely
+// and wrap, the difference is the fill level.
+template <uint32_t kSize>
+class SpscRing
+{
+	static_assert((kSize & (kSize - 1)) == 0, "ring size has to be a power of two");
+
+public:
+	// Producer side
+
+	uint32_t writable() const
+	{
+		return kSize - (m_head.load(std::memory_order_relaxed) - m_tail.load(std::memory_order_acquire));
+	}
+
+	// Contiguous free space at the head, up to the end of the buffer.
+	uint8_t *reserve(uint32_t *size)
+	{
+		uint32_t head = m_head.load(std::memory_order_relaxed);
+		uint32_t offset = head & (kSize - 1);
+		uint32_t space = writable();
+		*size = space < kSize - offset ? space : kSize - offset;
+		return m_data + offset;
+	}
+
+	void commit(uint32_t size)
+	{
+		m_head.store(m_head.load(std::memory_order_relaxed) + size, std::memory_order_release);
+	}
+
+	// Copies as much as fits, returns how much that was.
+	uint32_t write(const void *data, uint32_t size)
+	{
+		const uint8_t *p = (const uint8_t *)data;
+		uint32_t done = 0;
+		while (done < size)
+		{
+			uint32_t span;
+			uint8_t *dst = reserve(&span);
+			if (!span)
+				break;
+			if (span > size - done)
+				span = size - done;
+			memcpy(dst, p + done, span);
+			commit(span);
+			done += span;
+		}
+		return done;
+	}
+
+	// Consumer side
+
+	uint32_t readable() const
+	{
+		return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_relaxed);
+	}
+
+	// Contiguous data at the tail, up to the end of the buffer.
+	const uint8_t *peek(uint32_t *size) const
+	{
+		uint32_t tail = m_tail.load(std::memory_order_relaxed);
+		uint32_t offset = tail & (kSize - 1);
+		uint32_t used = readable();
+		*size = used < kSize - offset ? used : kSize - offset;
+		return m_data + offset;
+	}
+
+	void consume(uint32_t size)
+	{
+		m_tail.store(m_tail.load(std::memory_order_relaxed) + size, std::memory_order_release);
+	}
+
+	// Copies out as much as there is, returns how much that was.
+	uint32_t read(void *data, uint32_t size)
+	{
+		uint8_t *p = (uint8_t *)data;
+		uint32_t done = 0;
+		while (done < size)
+		{
+			uint32_t span;
+			const uint8_t *src = peek(&span);
+			if (!span)
+				break;
+			if (span > size - done)
+				span = size - done;
+			memcpy(p + done, src, span);
+			consume(span);
+			done += span;
+		}
+		return done;
+	}
+
+private:
+	std::atomic<uint32_t> m_head = 0;
+	std::atomic<uint32_t> m_tail = 0;
+	// DMA goes straight from here
+	uint8_t m_data[kSize] __attribute__((aligned(32)));
+};
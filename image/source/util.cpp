@@ -31,11 +31,11 @@ static int base64DecodeBatch(const char *start, uint8_t *out)
 	int data_end = 4;
 	for (int i = 0; i < 4; ++i)
 	{
-		char c = start[i];
+		uint8_t c = start[i];
 		if (c >= OC_ARRAYSIZE(k_lut))
 			return 0;
 
-		uint8_t data = k_lut[(int)c];
+		uint8_t data = k_lut[c];
 
 		// Check for bad symbol
 		if (data & 0x80)
@@ -111,4 +111,50 @@ bool base64Decode(const char *text, void **out_buf, int *out_len)
 	*out_len = buf_len;
 	*out_buf = buffer;
 	return true;
-}
\ No newline at end of file
+}
+bool base64Check(const char *text, int len, int *out_len)
+{
+	if (len % 4)
+		return false;
+
+	int batch_count = len / 4;
+	int buf_len = 0;
+	for (int i = 0; i < batch_count; ++i)
+	{
+		uint8_t batch[3];
+		int got = base64DecodeBatch(text + i * 4, batch);
+		if (!got)
+			return false;
+
+		// Check for padding mid-text
+		if (got < 3 && i != batch_count - 1)
+			return false;
+
+		buf_len += got;
+	}
+
+	*out_len = buf_len;
+	return true;
+}
+
+void base64DecodeRange(const char *text, int offset, void *out, int size)
+{
+	uint8_t *p = (uint8_t *)out;
+	const char *batch_text = text + offset / 3 * 4;
+	int skip = offset % 3;
+	while (size > 0)
+	{
+		uint8_t batch[3];
+		int got = base64DecodeBatch(batch_text, batch) - skip;
+		if (got <= 0)
+			break;
+		if (got > size)
+			got = size;
+
+		memcpy(p, batch + skip, got);
+		p += got;
+		size -= got;
+		skip = 0;
+		batch_text += 4;
+	}
+}
@@ -3,8 +3,15 @@
 #define OC_ARRAYSIZE(x) \
 	(sizeof((x)) / sizeof((x)[0]))
 
+#if OC_HOST_NATIVE
+// There is nobody to pull the plug on a native build, leave it to the host.
+[[noreturn]] void hostHang();
+#define OC_HANG() \
+	hostHang()
+#else
 #define OC_HANG() \
 	while (1)
+#endif
 
 #define OC_CONCAT_IMPL(s1, s2) s1##s2
 #define OC_CONCAT(s1, s2) OC_CONCAT_IMPL(s1, s2)
@@ -31,4 +38,10 @@ struct InitFunctionReg
 	static InitFunctionReg *s_pFirst;
 };
 
-bool base64Decode(const char *text, void **out_buf, int *out_len);
\ No newline at end of file
+bool base64Decode(const char *text, void **out_buf, int *out_len);
+
+// For decoding piece by piece: base64Check() validates len characters of
+// text like base64Decode() would and gives the decoded length, after that
+// base64DecodeRange() can decode any part of it.
+bool base64Check(const char *text, int len, int *out_len);
+void base64DecodeRange(const char *text, int offset, void *out, int size);
\ No newline at end of file
@@ -0,0 +1,494 @@
+#!/usr/bin/env python3
+# Load generator for the service.
+#
+# Opens a number of concurrent sessions against the service port and replays
+# a weighted mix of request flows modeled on the checker:
+#   math - stateless havoc variants (int/float/dup/rpt/del/drop/add/mul/poly/weight/inspect)
+#   user - havoc user/getn/setn/lockn and password putnoise/getnoise
+#   otp  - otp_init, then putflag/getflag through otp_sync/otp_auth
+# Every response is checked against the expected output. At the end it
+# reports throughput, latency percentiles and histogram, and the timeout,
+# error and Dolphin restart counts.
+#
+# Usage: python3 loadgen.py --sessions 16 --duration 60 --mix math:6,user:3,otp:1
+
+import argparse
+import asyncio
+import base64
+import collections
+import datetime
+import random
+import struct
+import subprocess
+import sys
+import time
+
+from Crypto.Cipher import ChaCha20
+
+PROMPT_TEXT = b"> "
+
+# Latency histogram bucket upper bounds in ms
+HISTOGRAM_BUCKETS = [1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000]
+
+rng = random.Random()
+
+def rand_uint(below=2**31):
+	return rng.randrange(below)
+def rand_sint(below=2**31):
+	raw = rand_uint(below)
+	if rand_bool():
+		raw = -raw
+	return raw
+def rand_bool():
+	return rng.choice([True, False])
+def rand_float(total=2**22, denom=2**7, signed=True):
+	raw = rng.randrange(total) / denom
+	if signed and rand_bool():
+		raw = -raw
+	return raw
+def f32(f):
+	return struct.unpack("f", struct.pack("f", f))[0]
+def rand_sv():
+	if rand_bool():
+		return rand_sint()
+	else:
+		return rand_float()
+
+def make_paired(vals):
+	paired_data = bytearray(1 + len(vals) * 2)
+	struct.pack_into("b", paired_data, 0, 0) # exponent
+	for i, v in enumerate(vals):
+		struct.pack_into(">h", paired_data, 1 + i * 2, v)
+	return "p{}".format(base64.b64encode(paired_data).decode())
+
+def make_cmd(cmd, args=[]):
+	text = cmd
+	for arg in args:
+		text += ":"
+		if isinstance(arg, int):
+			text += "i{}".format(arg)
+		elif isinstance(arg, float):
+			text += "f{}".format(arg)
+		else:
+			text += arg
+	return text
+
+def make_cmd_rand(cmd, args=[]):
+	# Same shapes as the checker: immediates either in place or pushed
+	# beforehand as decimal, hex or paired, with stack specifiers trimmed.
+	out_cmds = []
+	out_final_args = []
+	for arg in args:
+		if isinstance(arg, (int, float)) and rand_bool():
+			if isinstance(arg, int):
+				modes = ["dec", "hex"]
+				if -32767 <= arg <= 32767:
+					modes.append("paired")
+				mode = rng.choice(modes)
+				if mode == "dec":
+					out_cmds.append("int:i{}".format(arg))
+				elif mode == "hex":
+					out_cmds.append("int:i{}".format(hex(arg)))
+				else:
+					out_cmds.append("int:{}".format(make_paired([arg])))
+			else:
+				out_cmds.append(make_cmd("float", [arg]))
+			out_final_args.append("s")
+		else:
+			out_final_args.append(arg)
+
+	stack_suffix_len = 0
+	for a in reversed(out_final_args):
+		if a != "s":
+			break
+		stack_suffix_len += 1
+	trim = rng.randrange(stack_suffix_len + 1)
+	if trim > 0:
+		out_final_args = out_final_args[:-trim]
+
+	out_cmds.reverse()
+	out_cmds.append(make_cmd(cmd, out_final_args))
+	return out_cmds
+
+def make_user(uid, key):
+	return make_cmd("user", [uid[0], uid[1], key[0], key[1]])
+
+def make_put_data(nums):
+	cmds = []
+	cmds += [make_cmd("setn", [i, n]) for i, n in enumerate(nums)]
+	cmds += [make_cmd("lockn", [i]) for i, n in enumerate(nums)]
+	return cmds
+
+def make_get_data(count):
+	return [make_cmd("getn", [i]) for i in reversed(range(count))]
+
+def otp_code(otp, index):
+	gen = ChaCha20.new(key=otp["otp_key"], nonce=otp["otp_nonce"])
+	gen.seek(index * 8)
+	return struct.unpack_from(">ll", gen.encrypt(b"\x00" * 8), 0x0)
+
+def math_case():
+	# Returns (commands, expected output, expected inspect lines)
+	variant = rng.randrange(13)
+	if variant == 0:
+		val = rand_float()
+		return make_cmd_rand("int", [val]), [int(val)], []
+	elif variant == 1:
+		val = int(rand_float())
+		return make_cmd_rand("float", [val]), [float(val)], []
+	elif variant == 2:
+		val = rand_sv()
+		return make_cmd_rand("dup", [val]), [val, val], []
+	elif variant == 3:
+		val = rand_sv()
+		count = rng.randrange(32)
+		return make_cmd_rand("rpt", [count, val]), [val] * count, []
+	elif variant == 4:
+		vals = [rand_sv() for i in range(rng.randrange(32) + 1)]
+		cmds = []
+		for val in vals:
+			cmds += make_cmd_rand("stack", [val])
+		cmds += make_cmd_rand("del")
+		return cmds, list(reversed(vals[:-1])), []
+	elif variant == 5:
+		vals = [rand_sv() for i in range(rng.randrange(32) + 1)]
+		cmds = []
+		for val in vals:
+			cmds += make_cmd_rand("stack", [val])
+		count_drop = rng.randrange(len(vals))
+		cmds += make_cmd_rand("drop", [count_drop])
+		return cmds, list(reversed(vals[:len(vals) - count_drop])), []
+	elif variant == 6:
+		lhs = rand_sint(2 ** 20)
+		rhs = rand_sint(2 ** 20)
+		return make_cmd_rand("addi", [lhs, rhs]), [lhs + rhs], []
+	elif variant == 7:
+		lhs = rand_float()
+		rhs = rand_float()
+		return make_cmd_rand("addf", [lhs, rhs]), [f32(lhs + rhs)], []
+	elif variant == 8:
+		lhs = rand_sint(2 ** 14)
+		rhs = rand_sint(2 ** 14)
+		return make_cmd_rand("muli", [lhs, rhs]), [lhs * rhs], []
+	elif variant == 9:
+		lhs = rand_float(2 ** 10, 2 ** 5)
+		rhs = rand_float(2 ** 10, 2 ** 5)
+		return make_cmd_rand("mulf", [lhs, rhs]), [f32(lhs * rhs)], []
+	elif variant == 10:
+		x = rand_float(2 ** 8, 2 ** 2)
+		order = rand_uint(3)
+		coeffs = [rand_sint(2 ** 4) for i in range(order)]
+		y = 0.0
+		xp = 1.0
+		for c in coeffs:
+			y = f32(y + f32(c * xp))
+			xp = f32(xp * x)
+		return make_cmd_rand("poly", [order] + [x] + coeffs), [y], []
+	elif variant == 11:
+		count = rand_uint(10) + 1
+		coeffs = [rand_sint(2 ** 4) for _ in range(count)]
+		factors = [rand_float(2 ** 6, 2 ** 5) for _ in range(count)]
+		expected = sum([c * f for c, f in zip(coeffs, factors)])
+		weight_data = bytearray(count)
+		for i, f in enumerate(factors):
+			struct.pack_into("b", weight_data, i, int(f * (2 ** 6)))
+		cmds = []
+		for c in reversed(coeffs):
+			cmds += make_cmd_rand("float", [c])
+		cmds += [make_cmd("weight", [base64.b64encode(weight_data).decode()])]
+		return cmds, [expected], []
+	else:
+		count_int = rng.randrange(16)
+		count_float = rng.randrange(16)
+		vals_int = [rand_sint() for i in range(count_int)]
+		vals_float = [rand_float() for i in range(count_float)]
+		vals_remain = [rand_sv() for i in range(rng.randrange(4))]
+		cmds = []
+		for val in reversed(vals_int + vals_float + vals_remain):
+			cmds += make_cmd_rand("stack", [val])
+		cmds += make_cmd_rand("inspect", [count_int, count_float])
+		return cmds, vals_remain, [vals_int + vals_float]
+
+class FlowFailed(Exception):
+	pass
+
+class Stats:
+	def __init__(self):
+		self.latencies = collections.defaultdict(list)
+		self.results = collections.Counter()
+		self.flows = collections.Counter()
+		self.mismatches = 0
+
+	def record(self, flow, latency, status):
+		self.latencies[flow].append(latency)
+		self.results[status] += 1
+
+def parse_nums(text):
+	nums = []
+	for num_text in text.split():
+		if num_text[0] == "i":
+			nums.append(int(num_text[1:]))
+		elif num_text[0] == "f":
+			nums.append(f32(float(num_text[1:])))
+		else:
+			raise ValueError("bad number {}".format(num_text))
+	return nums
+
+class Session:
+	def __init__(self, args, stats):
+		self.args = args
+		self.stats = stats
+
+	async def connect(self):
+		try:
+			rx, tx = await asyncio.wait_for(
+				asyncio.open_connection(self.args.host, self.args.port),
+				self.args.timeout
+			)
+			await asyncio.wait_for(rx.readuntil(PROMPT_TEXT), self.args.timeout)
+		except (OSError, asyncio.IncompleteReadError, asyncio.TimeoutError):
+			self.stats.results["connect_failed"] += 1
+			raise FlowFailed()
+		return rx, tx
+
+	def close(self, conn):
+		rx, tx = conn
+		tx.close()
+
+	async def request(self, conn, flow, cmds):
+		rx, tx = conn
+		start = time.monotonic()
+		tx.write((" ".join(cmds) + "\n").encode())
+		try:
+			response = await asyncio.wait_for(rx.readuntil(PROMPT_TEXT), self.args.timeout)
+		except asyncio.TimeoutError:
+			self.stats.record(flow, time.monotonic() - start, "client_timeout")
+			raise FlowFailed()
+		except (OSError, asyncio.IncompleteReadError, asyncio.LimitOverrunError):
+			self.stats.record(flow, time.monotonic() - start, "disconnected")
+			raise FlowFailed()
+		latency = time.monotonic() - start
+
+		lines = response[:-len(PROMPT_TEXT)].decode(errors="replace").split("\n")[:-1]
+		last = lines[-1] if lines else ""
+		result = {"ok": False, "out": [], "mid": []}
+		if last.startswith("out:"):
+			status = "ok"
+			result["ok"] = True
+			result["out"] = parse_nums(last[4:])
+			for l in lines[:-1]:
+				if l.startswith("inspect:"):
+					result["mid"].append(parse_nums(l[8:]))
+		elif last == "error: timeout":
+			status = "timeout"
+		elif last == "error: internal":
+			status = "internal"
+		else:
+			status = "error"
+		self.stats.record(flow, latency, status)
+		if not result["ok"]:
+			raise FlowFailed()
+		return result
+
+	def expect(self, result, out, mid=None):
+		if tuple(result["out"]) != tuple(out) or (mid is not None and result["mid"] != mid):
+			self.stats.mismatches += 1
+
+	async def single_request(self, flow, cmds):
+		conn = await self.connect()
+		try:
+			return await self.request(conn, flow, cmds)
+		finally:
+			self.close(conn)
+
+	async def flow_math(self):
+		cmds, out, mid = math_case()
+		self.expect(await self.single_request("math", cmds), out, mid)
+
+	async def flow_user(self):
+		variant = rng.randrange(5)
+		uid = (rand_sint(), rand_sint())
+		key = (rand_sint(), rand_sint())
+		if variant == 0:
+			cmds = [make_user(uid, key), make_user(uid, (rand_sint(), rand_sint()))]
+			self.expect(await self.single_request("user", cmds), [0, 1])
+		elif variant == 1:
+			cmds = [make_user(uid, key), make_cmd("del")]
+			cmds += make_cmd_rand("getn", [rand_uint()])
+			self.expect(await self.single_request("user", cmds), [0])
+		elif variant == 2:
+			idx = rand_uint()
+			val = rand_sint()
+			cmds = [make_user(uid, key), make_cmd("del")]
+			cmds += make_cmd_rand("setn", [idx, val])
+			cmds += make_cmd_rand("getn", [idx])
+			self.expect(await self.single_request("user", cmds), [val])
+		elif variant == 3:
+			idx = rand_uint()
+			val = rand_sint()
+			cmds = [make_user(uid, key), make_cmd("del")]
+			cmds += make_cmd_rand("setn", [idx, val])
+			cmds += make_cmd_rand("getn", [idx])
+			cmds += make_cmd_rand("lockn", [idx])
+			cmds += make_cmd_rand("getn", [idx])
+			cmds += make_cmd_rand("setn", [idx, rand_sint()])
+			cmds += make_cmd_rand("getn", [idx])
+			self.expect(await self.single_request("user", cmds), [val, val, val])
+		else:
+			# putnoise, then getnoise on a fresh connection
+			nums = [rand_sint() for i in range(1 + rng.randrange(20))]
+			cmds = [make_user(uid, key), make_cmd("lockn", [0x20000000]), make_cmd("lockn", [0x20000001])]
+			cmds += make_put_data(nums)
+			await self.single_request("user", cmds)
+			cmds = [make_user(uid, key), make_cmd("del")]
+			cmds += make_get_data(len(nums))
+			self.expect(await self.single_request("user", cmds), nums)
+
+	async def otp_sync_auth(self, conn, uid, otp, cmds):
+		result = await self.request(conn, "otp", [make_cmd("otp_sync", [uid[0], uid[1]])])
+		if len(result["out"]) != 3:
+			self.stats.mismatches += 1
+			raise FlowFailed()
+		sync_index = result["out"][0]
+		if otp_code(otp, sync_index) != (result["out"][2], result["out"][1]):
+			self.stats.mismatches += 1
+			raise FlowFailed()
+		code = otp_code(otp, sync_index + 1)
+		auth = make_cmd("otp_auth", [uid[0], uid[1], code[0], code[1]])
+		return await self.request(conn, "otp", [auth] + cmds)
+
+	async def flow_otp(self):
+		uid = (rand_sint(), rand_sint())
+		result = await self.single_request("otp", [make_cmd("otp_init", [uid[0], uid[1]])])
+		output = list(reversed(result["out"]))
+		if len(output) != 11 or not output[0]:
+			self.stats.mismatches += 1
+			raise FlowFailed()
+		otp = {
+			"otp_key": b"".join([struct.pack(">l", s) for s in output[1:9]]),
+			"otp_nonce": b"".join([struct.pack(">l", s) for s in output[9:11]]),
+		}
+
+		# putflag
+		nums = [rand_uint(2 ** 24) for i in range(1 + rng.randrange(16))]
+		conn = await self.connect()
+		try:
+			await self.otp_sync_auth(conn, uid, otp, make_put_data(nums))
+		finally:
+			self.close(conn)
+
+		# getflag
+		conn = await self.connect()
+		try:
+			result = await self.otp_sync_auth(conn, uid, otp, [make_cmd("del")] + make_get_data(len(nums)))
+		finally:
+			self.close(conn)
+		self.expect(result, nums)
+
+	async def run(self, mix, deadline):
+		flows = [name for name, weight in mix]
+		weights = [weight for name, weight in mix]
+		while time.monotonic() < deadline:
+			flow = rng.choices(flows, weights)[0]
+			self.stats.flows[flow] += 1
+			try:
+				await getattr(self, "flow_" + flow)()
+			except FlowFailed:
+				self.stats.flows[flow + "_failed"] += 1
+
+def parse_mix(text):
+	mix = []
+	for part in text.split(","):
+		name, _, weight = part.partition(":")
+		if name not in ["math", "user", "otp"]:
+			raise argparse.ArgumentTypeError("unknown flow {}".format(name))
+		mix.append((name, float(weight or 1)))
+	return mix
+
+def count_log_restarts(compose_dir, since):
+	# Every restart in handle_dolphin ends with this line
+	try:
+		logs = subprocess.run(
+			["docker-compose", "logs", "--no-color", "--since", since],
+			cwd=compose_dir, capture_output=True, text=True, check=True
+		).stdout
+	except (OSError, subprocess.CalledProcessError) as ex:
+		print("Could not read service logs: {}".format(ex))
+		return None
+	return logs.count("Restart complete.")
+
+def report(stats, elapsed, log_restarts):
+	all_latencies = sorted([l for ls in stats.latencies.values() for l in ls])
+	total = len(all_latencies)
+	print("Duration: {:.1f}s".format(elapsed))
+	print("Flows: {}".format(", ".join(["{} {}".format(k, v) for k, v in sorted(stats.flows.items())])))
+	print("Requests: {}, throughput {:.1f} req/s".format(total, total / elapsed))
+	print("Results: {}".format(", ".join(["{} {}".format(k, v) for k, v in sorted(stats.results.items())])))
+	print("Output mismatches: {}".format(stats.mismatches))
+	if total:
+		timeouts = stats.results["timeout"] + stats.results["client_timeout"]
+		print("Timeout rate: {:.3f}%".format(timeouts * 100 / total))
+
+	# A restart fails exactly the request that was being served, with
+	# either of these two errors.
+	print("Dolphin restarts: {} (from responses)".format(stats.results["timeout"] + stats.results["internal"]))
+	if log_restarts is not None:
+		print("Dolphin restarts: {} (from service logs)".format(log_restarts))
+
+	def pct(samples, p):
+		return samples[min(len(samples) - 1, int(len(samples) * p))] * 1e3
+
+	print()
+	print("{:8} {:>8} {:>10} {:>10} {:>10} {:>10}".format("flow", "requests", "p50 ms", "p99 ms", "p999 ms", "max ms"))
+	for flow, samples in sorted(stats.latencies.items()) + [("all", all_latencies)]:
+		if not samples:
+			continue
+		samples = sorted(samples)
+		print("{:8} {:>8} {:>10.2f} {:>10.2f} {:>10.2f} {:>10.2f}".format(
+			flow, len(samples),
+			pct(samples, 0.5), pct(samples, 0.99), pct(samples, 0.999), samples[-1] * 1e3
+		))
+
+	if total:
+		print()
+		print("Latency histogram:")
+		counts = [0] * (len(HISTOGRAM_BUCKETS) + 1)
+		for l in all_latencies:
+			i = 0
+			while i < len(HISTOGRAM_BUCKETS) and l * 1e3 > HISTOGRAM_BUCKETS[i]:
+				i += 1
+			counts[i] += 1
+		for i, count in enumerate(counts):
+			label = "<= {}ms".format(HISTOGRAM_BUCKETS[i]) if i < len(HISTOGRAM_BUCKETS) else "> {}ms".format(HISTOGRAM_BUCKETS[-1])
+			print("{:>10} {:>8} {}".format(label, count, "#" * int(count * 50 / total)))
+
+async def main():
+	parser = argparse.ArgumentParser(description="Replay checker-like load against the service.")
+	parser.add_argument("--host", default="127.0.0.1")
+	parser.add_argument("--port", type=int, default=53273)
+	parser.add_argument("--sessions", type=int, default=8, help="concurrent sessions")
+	parser.add_argument("--duration", type=float, default=30.0, help="seconds to run")
+	parser.add_argument("--mix", type=parse_mix, default=parse_mix("math:6,user:3,otp:1"),
+		help="flow weights, e.g. math:6,user:3,otp:1")
+	parser.add_argument("--timeout", type=float, default=30.0, help="client-side timeout per request")
+	parser.add_argument("--seed", type=int, default=None)
+	parser.add_argument("--compose-dir", default=None,
+		help="docker-compose directory of the service, to count restarts from its logs")
+	args = parser.parse_args()
+
+	rng.seed(args.seed)
+	stats = Stats()
+	since = datetime.datetime.utcnow().strftime("%Y-%m-%dT%H:%M:%SZ")
+	start = time.monotonic()
+	deadline = start + args.duration
+	await asyncio.gather(*[Session(args, stats).run(args.mix, deadline) for i in range(args.sessions)])
+	elapsed = time.monotonic() - start
+
+	log_restarts = None
+	if args.compose_dir:
+		log_restarts = count_log_restarts(args.compose_dir, since)
+	report(stats, elapsed, log_restarts)
+	return 1 if stats.mismatches else 0
+
+if __name__ == "__main__":
+	sys.exit(asyncio.run(main()))
@@ -11,6 +11,14 @@ import traceback
 import subprocess
 
 import secrets
+import time
+import collections
+import bisect
+import heapq
+import json
+import random
+import re
+import concurrent.futures
 from Crypto.Cipher import ChaCha20
 
 SERVICE_PORT = 53273
@@ -20,7 +28,36 @@ IMAGE_PATH = "./image.dol"
 DATA_DIR = "/data"
 WORKER_COUNT = 2
 DATA_CLEANUP_EXPIRY_TIME = 15 * 60 # 15 minutes ~= 1 min/round * 10 rounds + margin
-DATA_CLEANUP_CYCLE_TIME = 5 * 60 # guarantees max age 20 minutes
+DATA_CLEANUP_CYCLE_TIME = 60
+DATA_EXPIRY_BUCKET_TIME = 60 # max age = expiry + bucket + cycle = 17 minutes
+DATA_CACHE_MAX_ENTRIES = 64 * 1024 # bound for cached file states
+STORAGE_THREAD_COUNT = 4 # threads doing disk I/O off the event loop
+STORAGE_FSYNC = True # sync every commit batch to disk
+OTP_CACHE_MAX_USERS = 4096 # bound for users with cached OTP state
+RESULT_CACHE_MAX_ENTRIES = 4096 # bound for cached results of pure requests
+RESULT_CACHE_MAX_BYTES = 16 * 1024 * 1024 # bound for the size of cached requests and results
+RESULT_CACHE_MAX_RESULT_SIZE = 64 * 1024 # larger results aren't cached
+REQUEST_PREVALIDATE = True # answer requests that are sure to fail on syntax without Dolphin
+COST_INITIAL_BASE = 0.005 # seconds per request until we learned better
+COST_INITIAL_UNIT = 0.0001 # seconds per command unit until we learned better
+COST_LEARNING_RATE = 0.05 # how far one observation moves the cost model
+SCHEDULE_STARVATION_TIME = 0.05 # requests waiting this long go first within their client's share, whatever they cost
+SCHEDULE_QUANTUM = 0.25 # seconds of expected work a client may send per round, at least one request
+CLIENT_MAX_INFLIGHT = None # requests queued or running per client address, None for no limit
+REQUEST_DEADLINE = 2.0 # seconds a client is expected to wait for an answer, later ones are dropped
+OTP_LEASE_CODES = 4 # codes handed to a session at once
+OTP_RESERVE_CODES = 256 # codes reserved on disk at once
+OTP_KEYSTREAM_CODES = 256 # codes generated at once
+OTP_REFRESH_TIME = 60 # rewrite the OTP file at least this often while in use
+LOOP_MONITOR_INTERVAL = 0.05 # how often to sample event loop lag
+LOOP_MONITOR_REPORT_TIME = 60 # how often to report event loop lag
+METRICS_PORT = 53274 # plain text metrics over HTTP, only mapped to localhost
+TRACE_PATH = None # Chrome trace-event output like "./trace.json", None to disable tracing
+TRACE_SAMPLE_RATE = 0.01 # fraction of requests traced
+TRACE_SLOW_TIME = 0.1 # requests slower than this are always traced
+TRACE_FILE_MAX_EVENTS = 100000 # rotate the trace file after this many events
+TRACE_FILE_COUNT = 3 # rotated trace files to keep
+METRICS_REQUEST_BUCKETS = [0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5] # seconds
 LOG_DEBUG = False
 
 MAX_REQUEST_SIZE = 1024 # maximum size for request to be passed into Dolphin
@@ -28,6 +65,15 @@ MAX_REQUEST_TIME = 0.25
 DOL_TIMEOUT = 2.0 # timeout for comms with Dolphin before abort & restart
 DOL_STARTUP_TIME = 20.0 # how long to wait for Dolphin to start up in seconds
 DOL_STARTUP_INTERVAL = 0.05 # wait time between successive attempts to get to Dolphin
+DOL_VERSION_TIME = 1.0 # how long to wait for the protocol version, older images don't answer
+DOL_PROTOCOL_VERSION = 2 # highest protocol version we speak
+DOL_MAX_INFLIGHT = 4 # requests sent to one Dolphin at once, if the image can run several
+DOL_MSG_V2 = 0x80000000 # set in len for v2 headers, which add request id and flags
+DOL_MSG_IDENTS = { # counted by name, everything else goes in as "other"
+	b"VERQ", b"VERA", b"RDYQ", b"REQQ", b"REQA", b"ERRQ", b"PRTQ", b"PERQ",
+	b"GTNQ", b"GTNA", b"STNQ", b"LKNQ", b"INSQ",
+	b"OTIQ", b"OTIA", b"OTAQ", b"OTAA", b"OTGQ", b"OTGA", b"OTNQ",
+}
 
 def log_debug(text):
 	if LOG_DEBUG:
@@ -40,68 +86,1184 @@ async def imm_error(t):
 		print("Task {} failed with traceback:".format(t))
 		traceback.print_exc()
 
+def num_file_name(uid, idx):
+	return "num_{:016x}_{:08x}".format(uid, idx)
+
+def lock_file_name(uid, idx):
+	return "lock_{:016x}_{:08x}".format(uid, idx)
+
+def otp_file_name(uid):
+	return "otp_{:016x}".format(uid)
+
+def msg_ident_label(ident):
+	# Idents come from the image, keep the metrics from growing with them
+	return ident.decode() if ident in DOL_MSG_IDENTS else "other"
+
+class DataStore:
+	"""Write-through cache in front of the files in DATA_DIR.
+
+	Every entry holds the file contents (None if the file doesn't exist) and
+	the modification time it was last known to have. Positive entries expire
+	together with the file they shadow, after which we go back to disk since
+	the cleanup may have removed it. Negative entries stay valid until we
+	write the file ourselves, as we are the only writer.
+
+	Disk access happens on a thread pool so it never blocks the event loop.
+	Writes and deletions go through a commit queue: everything queued while
+	the previous batch was in flight is written (and synced) in one go.
+
+	We also keep an index of all files in DATA_DIR by the time bucket they
+	were last written in, so the cleanup only has to look at files that are
+	actually due."""
+
+	def __init__(self, max_entries):
+		self.max_entries = max_entries
+		self.entries = collections.OrderedDict()
+		self.executor = concurrent.futures.ThreadPoolExecutor(
+			max_workers=STORAGE_THREAD_COUNT,
+			thread_name_prefix="storage"
+		)
+		self.reads_inflight = {}
+		self.commit_queue = {}
+		self.commit_futs = []
+		self.commit_wakeup = asyncio.Event()
+		self.expiry_index = {}
+		self.expiry_buckets = {}
+		self.hits = 0
+		self.misses = 0
+		self.commit_batches = 0
+		self.commit_ops = 0
+
+	def _insert(self, name, data, mtime):
+		self.entries[name] = (data, mtime)
+		self.entries.move_to_end(name)
+		while len(self.entries) > self.max_entries:
+			self.entries.popitem(last=False)
+
+	def _lookup(self, name):
+		entry = self.entries.get(name)
+		if entry is None:
+			return None
+
+		data, mtime = entry
+		if mtime is not None and time.time() - mtime >= DATA_CLEANUP_EXPIRY_TIME:
+			# Might be gone by now, have to check on disk
+			del self.entries[name]
+			return None
+
+		self.entries.move_to_end(name)
+		return entry
+
+	def _index(self, name, mtime):
+		bucket = int(mtime // DATA_EXPIRY_BUCKET_TIME)
+		old_bucket = self.expiry_index.get(name)
+		if old_bucket == bucket:
+			return
+		if old_bucket is not None:
+			self._unindex(name)
+		self.expiry_index[name] = bucket
+		self.expiry_buckets.setdefault(bucket, set()).add(name)
+
+	def _unindex(self, name):
+		bucket = self.expiry_index.pop(name)
+		names = self.expiry_buckets[bucket]
+		names.discard(name)
+		if not names:
+			del self.expiry_buckets[bucket]
+
+	@staticmethod
+	def _disk_scan():
+		found = []
+		with os.scandir(DATA_DIR) as it:
+			for de in it:
+				# Skip irrelevant stuff
+				if de.name.startswith("."):
+					continue
+				try:
+					if not de.is_file():
+						continue
+					found.append((de.name, de.stat().st_mtime))
+				except FileNotFoundError:
+					pass
+		return found
+
+	async def load_index(self):
+		"""Index whatever is already on disk. This is the only full scan of
+		DATA_DIR, done once at startup."""
+		found = await asyncio.get_running_loop().run_in_executor(self.executor, self._disk_scan)
+		for name, mtime in found:
+			# Don't clobber anything we wrote while scanning
+			if name not in self.expiry_index:
+				self._index(name, mtime)
+		return len(found)
+
+	def take_expired(self, age):
+		"""Remove and return all names in buckets that are entirely older than
+		age seconds, along with the number of buckets they came from."""
+		last_bucket = int((time.time() - age) // DATA_EXPIRY_BUCKET_TIME) - 1
+		due_buckets = [b for b in self.expiry_buckets if b <= last_bucket]
+		names = []
+		for bucket in due_buckets:
+			for name in self.expiry_buckets.pop(bucket):
+				del self.expiry_index[name]
+				names.append(name)
+		return names, len(due_buckets)
+
+	@staticmethod
+	def _disk_read(name):
+		try:
+			with open(os.path.join(DATA_DIR, name), "rb") as f:
+				data = f.read()
+				mtime = os.fstat(f.fileno()).st_mtime
+		except FileNotFoundError:
+			data = None
+			mtime = None
+		return data, mtime
+
+	@staticmethod
+	def _disk_commit(batch):
+		# Runs on the storage pool, one batch at a time. A file that fails
+		# doesn't keep the others from being written.
+		expired = {}
+		failed = {}
+		now = time.time()
+		for name, (op, arg) in batch.items():
+			path = os.path.join(DATA_DIR, name)
+			if op == "write":
+				try:
+					fd = os.open(path, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+					try:
+						os.write(fd, arg)
+						if STORAGE_FSYNC:
+							os.fsync(fd)
+					finally:
+						os.close(fd)
+				except OSError as ex:
+					print("Data commit failed to write {}, traceback:".format(path))
+					traceback.print_exc()
+					failed[name] = ex
+			elif op == "expire":
+				# Only delete if it wasn't refreshed in the meantime
+				mtime = None
+				try:
+					mtime = os.stat(path).st_mtime
+					if now - mtime < arg:
+						expired[name] = mtime
+						continue
+					os.remove(path)
+					expired[name] = None
+				except FileNotFoundError:
+					expired[name] = None
+				except OSError:
+					print("Data cleanup failed to delete {}, traceback:".format(path))
+					traceback.print_exc()
+					# Try again a full expiry period from now, stat() might
+					# not have got as far as an mtime
+					expired[name] = time.time()
+		if STORAGE_FSYNC:
+			dir_fd = os.open(DATA_DIR, os.O_RDONLY)
+			try:
+				os.fsync(dir_fd)
+			finally:
+				os.close(dir_fd)
+		return expired, failed
+
+	async def read(self, name):
+		entry = self._lookup(name)
+		if entry is not None:
+			self.hits += 1
+			return entry[0]
+
+		# Share the disk read with anyone else missing on the same file
+		inflight = self.reads_inflight.get(name)
+		if inflight is not None:
+			self.hits += 1
+			data, mtime = await asyncio.shield(inflight["fut"])
+			return data
+
+		self.misses += 1
+		inflight = {
+			"fut": asyncio.get_running_loop().run_in_executor(self.executor, self._disk_read, name),
+			"stale": False,
+		}
+		self.reads_inflight[name] = inflight
+		try:
+			data, mtime = await asyncio.shield(inflight["fut"])
+		finally:
+			del self.reads_inflight[name]
+
+		# A write that raced us already put the newer state in the cache
+		if not inflight["stale"]:
+			self._insert(name, data, mtime)
+		return data
+
+	async def exists(self, name):
+		return await self.read(name) is not None
+
+	def write(self, name, data):
+		"""Update the cache right away and queue the write for the next
+		commit. Returns a future that resolves once the data is on disk, or
+		fails if it couldn't be written; the cache forgets it then."""
+		data = bytes(data)
+		inflight = self.reads_inflight.get(name)
+		if inflight is not None:
+			inflight["stale"] = True
+		now = time.time()
+		self._insert(name, data, now)
+		self._index(name, now)
+		self.commit_queue[name] = ("write", data)
+		return self._commit_fut([name])
+
+	def expire(self, names, age):
+		"""Queue deletion of files that haven't been written for age seconds.
+		The future resolves to a dict of the names we looked at, mapping
+		to None if they are gone or to their mtime if they were kept."""
+		for name in names:
+			# A pending write always wins.
+			if name not in self.commit_queue:
+				self.commit_queue[name] = ("expire", age)
+		return self._commit_fut([])
+
+	def _commit_fut(self, names):
+		# Resolves with the batch, or fails if any of names failed
+		fut = asyncio.get_running_loop().create_future()
+		self.commit_futs.append((names, fut))
+		self.commit_wakeup.set()
+		return fut
+
+	def _forget_failed(self, batch, failed):
+		for name in failed:
+			# A newer write already queued is what the cache holds now
+			if batch[name][0] == "write" and name not in self.commit_queue:
+				self.entries.pop(name, None)
+
+	async def handle_commits(self):
+		loop = asyncio.get_running_loop()
+		while True:
+			await self.commit_wakeup.wait()
+			self.commit_wakeup.clear()
+
+			batch = self.commit_queue
+			futs = self.commit_futs
+			self.commit_queue = {}
+			self.commit_futs = []
+			if not batch:
+				for names, fut in futs:
+					fut.set_result({})
+				continue
+
+			try:
+				expired, failed = await loop.run_in_executor(self.executor, self._disk_commit, batch)
+			except Exception as ex:
+				print("Data commit of {} files failed, traceback:".format(len(batch)))
+				traceback.print_exc()
+				# Nothing is known to be on disk, the cache can't say otherwise
+				self._forget_failed(batch, batch)
+				# Retry the deletions next cycle
+				for name, (op, arg) in batch.items():
+					if op == "expire" and name not in self.expiry_index:
+						self._index(name, time.time() - arg)
+				for names, fut in futs:
+					fut.set_exception(ex)
+				continue
+			self._forget_failed(batch, failed)
+
+			for name, mtime in expired.items():
+				if mtime is None:
+					# Could have been written again while we were deleting;
+					# the write is then still queued and will recreate it.
+					if name not in self.commit_queue:
+						self._insert(name, None, None)
+				elif name not in self.expiry_index:
+					# Still there, so it has to stay indexed
+					self._index(name, mtime)
+
+			self.commit_batches += 1
+			self.commit_ops += len(batch)
+			for names, fut in futs:
+				errors = [failed[name] for name in names if name in failed]
+				if errors:
+					fut.set_exception(errors[0])
+				else:
+					fut.set_result(expired)
+
+	def stats(self):
+		return "entries {}, indexed {}, hits {}, misses {}, commits {} ({} files)".format(
+			len(self.entries),
+			len(self.expiry_index),
+			self.hits,
+			self.misses,
+			self.commit_batches,
+			self.commit_ops
+		)
+
+class OtpManager:
+	"""Hands out OTP codes to sessions.
+
+	The OTP file holds the key, nonce and the index of the first code that
+	has never been handed out. Instead of advancing it for every session, we
+	reserve OTP_RESERVE_CODES at once and only hand out codes below the index
+	that is durably on disk. After a crash or eviction we continue from the
+	file, skipping whatever was left of the reservation, so no code is ever
+	handed out twice. The keystream is the same ChaCha20 stream as before, we
+	just generate it in bigger blocks and keep it around across sessions."""
+
+	def __init__(self, store, max_users):
+		self.store = store
+		self.max_users = max_users
+		self.users = collections.OrderedDict()
+
+	def forget(self, uid):
+		self.users.pop(uid, None)
+
+	def _load(self, uid, otp_secret):
+		state = {
+			"secret": bytes(otp_secret[0x4:0x2c]),
+			"next": struct.unpack_from(">L", otp_secret, 0x0)[0],
+			"reserved": struct.unpack_from(">L", otp_secret, 0x0)[0],
+			"reserve_fut": None,
+			"persist_time": 0,
+			"gen": None,
+			"stream_start": 0,
+			"stream": b"",
+		}
+		self.users[uid] = state
+		while len(self.users) > self.max_users:
+			self.users.popitem(last=False)
+		return state
+
+	def _keystream(self, state, offset, count):
+		stream_end = state["stream_start"] + len(state["stream"]) // 8
+		if state["stream_start"] <= offset and offset + count <= stream_end:
+			start = (offset - state["stream_start"]) * 8
+			return state["stream"][start:start + count * 8]
+
+		# Generate a new block. Usually this continues right where the last
+		# one ended, so we can keep the cipher.
+		if state["gen"] is None or offset != stream_end:
+			state["gen"] = ChaCha20.new(key=state["secret"][0x0:0x20], nonce=state["secret"][0x20:0x28])
+			state["gen"].seek(offset * 8)
+		block_codes = max(count, OTP_KEYSTREAM_CODES)
+		state["stream_start"] = offset
+		state["stream"] = state["gen"].encrypt(b"\x00" * (block_codes * 8))
+		return state["stream"][:count * 8]
+
+	async def lease(self, uid, count, commits):
+		"""Returns the offset and keystream of count fresh codes, or None if
+		OTP isn't enabled for the user."""
+		otp_name = otp_file_name(uid)
+		otp_secret = await self.store.read(otp_name)
+		if otp_secret is None:
+			# Not enabled, or expired
+			self.forget(uid)
+			return None
+
+		state = self.users.get(uid)
+		if state is None or state["secret"] != otp_secret[0x4:0x2c]:
+			state = self._load(uid, otp_secret)
+		self.users.move_to_end(uid)
+
+		while state["next"] + count > state["reserved"]:
+			if state["reserve_fut"] is not None:
+				# Someone else is already extending the reservation
+				await asyncio.shield(state["reserve_fut"])
+				continue
+
+			reserved = state["next"] + count + OTP_RESERVE_CODES
+			otp_data = bytearray(otp_secret)
+			struct.pack_into(">L", otp_data, 0x0, reserved)
+			state["reserve_fut"] = self.store.write(otp_name, otp_data)
+			state["persist_time"] = time.time()
+			try:
+				# Must be on disk before we use any of it
+				await asyncio.shield(state["reserve_fut"])
+			finally:
+				state["reserve_fut"] = None
+			state["reserved"] = max(state["reserved"], reserved)
+
+		offset = state["next"]
+		state["next"] += count
+
+		# Keep the file from expiring while the user is active
+		if state["reserve_fut"] is None and time.time() - state["persist_time"] >= OTP_REFRESH_TIME:
+			otp_data = bytearray(otp_secret)
+			struct.pack_into(">L", otp_data, 0x0, state["reserved"])
+			state["persist_time"] = time.time()
+			commits.append(self.store.write(otp_name, otp_data))
+
+		return offset, self._keystream(state, offset, count)
+
+class ResultCache:
+	"""Results of requests that don't touch any user state, keyed by the
+	request bytes. The engine computes those from the request text alone, so
+	a repeat can be answered without going to Dolphin at all.
+
+	A request is pure if none of its commands is one of IMPURE_COMMANDS. We
+	split it up like Engine::run() does: commands are separated by spaces and
+	the name ends at the first colon. Unknown names are fine, they always
+	fail the same way.
+
+	Bounded by entries and by the bytes of requests and results together.
+	Results over RESULT_CACHE_MAX_RESULT_SIZE aren't worth the room."""
+
+	IMPURE_COMMANDS = {
+		b"user",
+		b"getn",
+		b"setn",
+		b"lockn",
+		b"otp_init",
+		b"otp_auth",
+		b"otp_sync",
+	}
+
+	def __init__(self, max_entries, max_bytes):
+		self.max_entries = max_entries
+		self.max_bytes = max_bytes
+		self.entries = collections.OrderedDict()
+		self.bytes = 0
+		self.hits = 0
+		self.misses = 0
+		self.impure = 0
+
+	@staticmethod
+	def is_pure(data):
+		for cmd in data.split(b" "):
+			if cmd.split(b":", 1)[0] in ResultCache.IMPURE_COMMANDS:
+				return False
+		return True
+
+	def lookup(self, data):
+		result = self.entries.get(data)
+		if result is None:
+			self.misses += 1
+			return None
+
+		self.hits += 1
+		self.entries.move_to_end(data)
+		return result
+
+	def insert(self, data, result):
+		if len(result) > RESULT_CACHE_MAX_RESULT_SIZE:
+			return
+		old = self.entries.pop(data, None)
+		if old is not None:
+			self.bytes -= len(data) + len(old)
+		self.entries[data] = result
+		self.bytes += len(data) + len(result)
+		while len(self.entries) > self.max_entries or self.bytes > self.max_bytes:
+			old_data, old = self.entries.popitem(last=False)
+			self.bytes -= len(old_data) + len(old)
+
+	def stats(self):
+		return "entries {}, bytes {}, hits {}, misses {}, impure {}".format(
+			len(self.entries),
+			self.bytes,
+			self.hits,
+			self.misses,
+			self.impure
+		)
+
+class RequestValidator:
+	"""Finds requests the engine is sure to answer with a syntax error.
+
+	This follows Engine::run() and prepareNextArg() up to the first error,
+	for as long as it can tell exactly what the engine would do. Commands
+	that talk to us, use GQR2, vectors or a variable number of arguments
+	could fail some other way first, so once one of those comes up we leave
+	the request to Dolphin. The same goes for a stack overflow, the engine
+	puts the value in the message, and for immediates where strtol()/strtof()
+	might differ between libc versions.
+
+	COMMANDS has to match s_commands of the image, built with OC_FINAL and
+	without OC_MINIMAL_DOCS."""
+
+	COMMANDS = {
+		b"int", b"float", b"dup", b"rpt", b"del", b"drop", b"stack",
+		b"addi", b"addf", b"muli", b"mulf",
+		b"poly", b"weight",
+		b"user", b"getn", b"setn", b"lockn",
+		b"otp_init", b"otp_auth", b"otp_sync",
+		b"vec", b"vaddf", b"vmulf", b"vscale", b"vsumf", b"vdotf",
+		b"sumi", b"sumf", b"minf", b"maxf", b"scanf",
+		b"inspect", b"print", b"help",
+	}
+
+	# Commands that read all of their arguments before doing anything else
+	# and can't fail otherwise: arguments read, entries pushed
+	SIMPLE_COMMANDS = {
+		b"int": (1, 1),
+		b"float": (1, 1),
+		b"stack": (1, 1),
+		b"dup": (1, 2),
+		b"del": (1, 0),
+		b"addi": (2, 1),
+		b"addf": (2, 1),
+		b"muli": (2, 1),
+		b"mulf": (2, 1),
+	}
+
+	STACK_SIZE = 256
+
+	# Whole immediates strtol(text, &end, 0) and strtof() take, leading
+	# whitespace and all. Empty text is fine too, it reads as zero.
+	INT_RE = re.compile(rb"[ \t\n\v\f\r]*[+-]?(0[xX][0-9a-fA-F]+|0[0-7]*|[1-9][0-9]*)")
+	FLOAT_RE = re.compile(rb"[ \t\n\v\f\r]*[+-]?((\d+\.?\d*|\.\d+)(e[+-]?\d+)?|inf|infinity|nan)", re.IGNORECASE)
+	# Hex floats and NaN payloads, not every libc takes them
+	FLOAT_UNSURE_RE = re.compile(rb"[ \t\n\v\f\r]*[+-]?(0x|nan\()", re.IGNORECASE)
+
+	B64_SYMBOLS = b"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"
+
+	@staticmethod
+	def _base64_len(text):
+		"""Decoded length like base64Check(), None if that fails."""
+		if len(text) % 4:
+			return None
+		out_len = 0
+		for i in range(0, len(text), 4):
+			data_end = 4
+			for j, c in enumerate(text[i:i + 4]):
+				if c == ord("="):
+					# Padding, at least one byte first and only at the end
+					if j < 2:
+						return None
+					data_end = min(data_end, j)
+				elif c in RequestValidator.B64_SYMBOLS:
+					if data_end < 4:
+						return None
+				else:
+					return None
+			if data_end < 4 and i != len(text) - 4:
+				return None
+			out_len += data_end - 1
+		return out_len
+
+	@classmethod
+	def _check_immediate(cls, code, text):
+		"""Error of one immediate, b"" if there is none, None if unsure.
+		Also returns how many values it holds."""
+		if not text.isascii():
+			return None, 0
+		if code == ord("i"):
+			if text and not cls.INT_RE.fullmatch(text):
+				return b"invalid argument: unexpected post-immediate text", 0
+			return b"", 1
+		elif code == ord("f"):
+			if cls.FLOAT_UNSURE_RE.match(text):
+				return None, 0
+			if text and not cls.FLOAT_RE.fullmatch(text):
+				return b"invalid argument: unexpected post-immediate text", 0
+			return b"", 1
+		elif code == ord("p"):
+			b64_len = cls._base64_len(text)
+			if b64_len is None:
+				return b"invalid argument: bad paired text", 0
+			# Scale byte, then 16 bits per value
+			if b64_len < 3 or (b64_len - 1) % 2 != 0:
+				return b"invalid argument: bad paired len", 0
+			return b"", (b64_len - 1) // 2
+		return b"invalid argument: unexpected type code", 0
+
+	@classmethod
+	def check(cls, data):
+		"""Returns the text of the error the engine is sure to answer with,
+		or None if it might answer anything else."""
+		# The engine stops at the first null byte
+		data = data.split(b"\0", 1)[0]
+
+		depth = 0
+		for cmd in data.split(b" "):
+			if not cmd:
+				continue
+
+			name, sep, arg = cmd.partition(b":")
+			arg = sep + arg
+			if name not in cls.COMMANDS:
+				return b"invalid command"
+
+			shape = cls.SIMPLE_COMMANDS.get(name)
+			if shape is None:
+				return None
+			reads, pushes = shape
+
+			pos = 0
+			values_left = 0
+			for _ in range(reads):
+				# Rest of a paired immediate
+				if values_left:
+					values_left -= 1
+					continue
+
+				# Nothing left, drawn from the stack or zero
+				if pos >= len(arg):
+					depth = max(depth - 1, 0)
+					continue
+
+				# Skip the ':'
+				pos += 1
+				if pos >= len(arg):
+					return b"invalid argument: expected type code"
+				code = arg[pos]
+				pos += 1
+
+				end = arg.find(b":", pos)
+				if end < 0:
+					end = len(arg)
+
+				if code == ord("s"):
+					depth = max(depth - 1, 0)
+					if end != pos:
+						return b"invalid argument: unexpected post-immediate text"
+				else:
+					error, count = cls._check_immediate(code, arg[pos:end])
+					if error is None or error:
+						return error
+					values_left = count - 1
+				pos = end
+
+			# Overflow errors carry the value, let the engine say it
+			if depth + pushes > cls.STACK_SIZE:
+				return None
+			depth += pushes
+
+		return None
+
+class CostModel:
+	"""Expected time a request takes in Dolphin.
+
+	Every command counts as one unit, plus the values it works through: the
+	count of rpt, poly and the like if it's an immediate, the values of
+	paired immediates and the quants in weight's Base64. The time per unit
+	of each command and a fixed time per request are learned from the
+	service times we see, by normalized least mean squares."""
+
+	# Commands whose first argument is how many values they go through
+	COUNT_COMMANDS = {
+		b"rpt", b"drop", b"poly", b"vec",
+		b"sumi", b"sumf", b"minf", b"maxf", b"scanf",
+	}
+	MAX_COUNT = 256
+
+	def __init__(self):
+		self.base = COST_INITIAL_BASE
+		self.unit = collections.defaultdict(lambda: COST_INITIAL_UNIT)
+
+	@classmethod
+	def features(cls, data):
+		"""Units per command name, unknown names go together under b"?"."""
+		features = {}
+		for cmd in data.split(b" "):
+			if not cmd:
+				continue
+
+			name, _, arg = cmd.partition(b":")
+			if name not in RequestValidator.COMMANDS:
+				name = b"?"
+			imms = arg.split(b":") if arg else []
+
+			units = 1
+			if name == b"weight":
+				# 8-bit quants
+				units += len(arg) * 3 // 4
+			else:
+				for imm in imms:
+					if imm.startswith(b"p"):
+						# Scale byte, then 16 bits per value
+						units += max(len(imm) - 1, 0) * 3 // 8
+				if name in cls.COUNT_COMMANDS and imms and imms[0].startswith(b"i"):
+					try:
+						count = int(imms[0][1:], 0)
+					except ValueError:
+						count = 0
+					units += min(max(count, 0), cls.MAX_COUNT)
+			features[name] = features.get(name, 0) + units
+		return features
+
+	def predict(self, features):
+		return self.base + sum(self.unit[name] * units for name, units in features.items())
+
+	def learn(self, features, seconds):
+		error = seconds - self.predict(features)
+		step = COST_LEARNING_RATE * error / (1 + sum(units * units for units in features.values()))
+		self.base = max(self.base + step, 0.0)
+		for name, units in features.items():
+			self.unit[name] = max(self.unit[name] + step * units, 0.0)
+
+class RequestScheduler(asyncio.Queue):
+	"""Requests waiting for a worker, in one queue per connection, grouped by
+	client address. Groups take turns by deficit round robin: every turn the
+	deficit grows by SCHEDULE_QUANTUM seconds of expected work and requests
+	may go while it covers their cost. Opening more connections doesn't get
+	a client more than its address's share.
+
+	Within a group, the connection whose next request is expected to be done
+	soonest goes first. Whatever has waited SCHEDULE_STARVATION_TIME goes
+	ahead of that in the order it came in, so clients behind the same NAT
+	with expensive requests still get their turn while cheap ones keep
+	coming. A connection's own requests go in order.
+
+	Items are (task, persistent) like before; the task carries its
+	"client", "connection", "cost" and "submit_time". The expected cost of
+	everything queued is kept in cost. The next request of every connection
+	in a group sits in a heap by cost and one by age at the same time,
+	whichever takes one marks it so the other one skips it."""
+
+	def _init(self, maxsize):
+		self.groups = {}
+		self.active = collections.deque()
+		self.size = 0
+		self.cost = 0.0
+		self.seq = 0
+		self.starved = 0
+
+	# asyncio.Queue only has hooks for storage, it counts on its own
+	def qsize(self):
+		return self.size
+
+	def empty(self):
+		return not self.size
+
+	def connections(self):
+		return sum(len(group["flows"]) for group in self.groups.values())
+
+	@staticmethod
+	def _push_head(group, entry):
+		heapq.heappush(group["by_cost"], entry)
+		heapq.heappush(group["by_age"], (entry[2][0]["submit_time"], entry[1], entry))
+
+	def _put(self, item):
+		task, persistent = item
+		group = self.groups.get(task["client"])
+		if group is None:
+			group = self.groups[task["client"]] = {
+				"flows": {},
+				"by_cost": [],
+				"by_age": [],
+				"deficit": 0.0,
+			}
+			self.active.append(task["client"])
+
+		entry = [task["cost"], self.seq, item, False]
+		self.seq += 1
+		flow = group["flows"].get(task["connection"])
+		if flow is None:
+			flow = group["flows"][task["connection"]] = collections.deque()
+			self._push_head(group, entry)
+		flow.append(entry)
+		self.size += 1
+		self.cost += task["cost"]
+
+	def _next(self, group):
+		"""The entry the group sends next, and the heap it comes from."""
+		by_age = group["by_age"]
+		while by_age[0][2][3]:
+			heapq.heappop(by_age)
+		if time.monotonic() - by_age[0][0] >= SCHEDULE_STARVATION_TIME:
+			return by_age[0][2], by_age
+
+		by_cost = group["by_cost"]
+		while by_cost[0][3]:
+			heapq.heappop(by_cost)
+		return by_cost[0], by_cost
+
+	def _get(self):
+		while True:
+			group = self.groups[self.active[0]]
+			entry, side = self._next(group)
+			if group["deficit"] >= entry[0]:
+				break
+			group["deficit"] += SCHEDULE_QUANTUM
+			self.active.rotate(-1)
+
+		heapq.heappop(side)
+		if side is group["by_age"]:
+			self.starved += 1
+		entry[3] = True
+		group["deficit"] -= entry[0]
+		self.size -= 1
+		# Don't let rounding errors pile up
+		self.cost = self.cost - entry[0] if self.size else 0.0
+
+		task, persistent = entry[2]
+		flow = group["flows"][task["connection"]]
+		flow.popleft()
+		if flow:
+			self._push_head(group, flow[0])
+		else:
+			del group["flows"][task["connection"]]
+			# Idle clients don't save up
+			if not group["flows"]:
+				del self.groups[self.active.popleft()]
+				return entry[2]
+
+		if len(group["by_cost"]) > 2 * len(group["flows"]) + 64:
+			# Drop what the other heap still holds once it adds up
+			group["by_cost"] = [e for e in group["by_cost"] if not e[3]]
+			heapq.heapify(group["by_cost"])
+		if len(group["by_age"]) > 2 * len(group["flows"]) + 64:
+			group["by_age"] = [e for e in group["by_age"] if not e[2][3]]
+			heapq.heapify(group["by_age"])
+		return entry[2]
+
+class RequestTrace:
+	"""Spans of one request, in seconds since the tracer was created.
+
+	Every request is recorded, whether it is written out is only decided
+	when it finished, so slow requests can be kept regardless of sampling.
+	Host message exchanges are split into time spent waiting for the backend
+	(from when we start reading to its next message), time spent answering
+	its queries (from the query to our answer) and time spent handling its
+	other messages (until we read again)."""
+
+	# Queries the backend waits on an answer for
+	QUERY_IDENTS = [b"GTNQ", b"OTIQ", b"OTAQ", b"OTGQ"]
+
+	def __init__(self, tracer, request_id, data):
+		self.tracer = tracer
+		self.request_id = request_id
+		self.data = data
+		self.worker_id = None
+		self.start = tracer.now()
+		self.events = []
+		self.backend_start = None
+		self.query = None
+		self.handling = None
+
+	def span(self, name, start, end=None, args=None):
+		if end is None:
+			end = self.tracer.now()
+		self.events.append((name, start, end - start, args))
+
+	def instant(self, name, args=None):
+		self.events.append((name, self.tracer.now(), None, args))
+
+	def on_send(self, ident, size):
+		now = self.tracer.now()
+		if self.query is not None:
+			query_ident, query_start = self.query
+			self.span(query_ident, query_start, now, {"answer": ident, "len": size})
+			self.query = None
+		else:
+			self.instant("send " + ident, {"len": size})
+
+	def on_wait(self):
+		now = self.tracer.now()
+		if self.handling is not None:
+			ident, handling_start, size = self.handling
+			self.span(ident, handling_start, now, {"len": size})
+			self.handling = None
+		self.backend_start = now
+
+	def on_recv(self, ident, size):
+		now = self.tracer.now()
+		if self.backend_start is not None:
+			self.span("backend", self.backend_start, now, {"until": ident})
+			self.backend_start = None
+		if ident.encode() in self.QUERY_IDENTS:
+			self.query = (ident, now)
+		elif ident == "REQA":
+			self.instant("recv " + ident, {"len": size})
+		else:
+			self.handling = (ident, now, size)
+
+class Tracer:
+	"""Writes sampled request traces in the Chrome trace-event format, which
+	chrome://tracing and Perfetto can open. Each request is its own thread
+	in the trace. Files are JSON arrays without the closing bracket, which
+	the format allows, so we can keep appending; they rotate to .1, .2, ...
+	after TRACE_FILE_MAX_EVENTS.
+
+	Writes go through the storage threads, one batch at a time so events
+	stay in order. Traces only record sizes and command names, never what
+	was sent or answered, since that holds keys and flags."""
+
+	def __init__(self, path, executor):
+		self.path = path
+		self.executor = executor
+		self.origin = time.perf_counter()
+		self.file = None
+		self.file_events = 0
+		self.written = 0
+		self.pending = []
+		self.flushing = None
+
+	def now(self):
+		return time.perf_counter() - self.origin
+
+	def begin(self, request_id, data):
+		if self.path is None:
+			return None
+		return RequestTrace(self, request_id, data)
+
+	def finish(self, trace):
+		if trace is None:
+			return
+		duration = self.now() - trace.start
+		if duration < TRACE_SLOW_TIME and random.random() >= TRACE_SAMPLE_RATE:
+			return
+
+		events = [{
+			"name": "thread_name",
+			"ph": "M",
+			"pid": 1,
+			"tid": trace.request_id,
+			"args": {"name": "request {} (worker {})".format(trace.request_id, trace.worker_id)},
+		}]
+		for name, start, length, args in trace.events:
+			event = {
+				"name": name,
+				"ph": "X" if length is not None else "i",
+				"ts": start * 1e6,
+				"pid": 1,
+				"tid": trace.request_id,
+			}
+			if length is not None:
+				event["dur"] = length * 1e6
+			else:
+				event["s"] = "t"
+			if args:
+				event["args"] = args
+			events.append(event)
+
+		# Drop traces rather than pile them up if the disk can't keep up
+		if len(self.pending) >= TRACE_FILE_MAX_EVENTS:
+			return
+		self.pending.extend(events)
+		self.written += 1
+		if self.flushing is None:
+			self.flushing = asyncio.create_task(imm_error(self._flush()))
+
+	async def _flush(self):
+		loop = asyncio.get_running_loop()
+		try:
+			while self.pending:
+				events, self.pending = self.pending, []
+				try:
+					await loop.run_in_executor(self.executor, self._write, events)
+				except OSError as ex:
+					print("Trace write failed: {}".format(ex))
+		finally:
+			self.flushing = None
+
+	def _rotate(self):
+		if self.file is not None:
+			self.file.close()
+			self.file = None
+		for i in reversed(range(1, TRACE_FILE_COUNT)):
+			src = self.path if i == 1 else "{}.{}".format(self.path, i - 1)
+			if os.path.exists(src):
+				os.replace(src, "{}.{}".format(self.path, i))
+
+	def _write(self, events):
+		if self.file is not None and self.file_events >= TRACE_FILE_MAX_EVENTS:
+			self._rotate()
+		if self.file is None:
+			if os.path.exists(self.path):
+				self._rotate()
+			self.file = open(self.path, "w")
+			self.file.write("[\n")
+			self.file_events = 0
+
+		for event in events:
+			self.file.write(json.dumps(event))
+			self.file.write(",\n")
+		self.file.flush()
+		self.file_events += len(events)
+
+class Histogram:
+	def __init__(self, buckets):
+		self.buckets = buckets
+		self.counts = [0] * (len(buckets) + 1)
+		self.sum = 0.0
+
+	def observe(self, value):
+		self.counts[bisect.bisect_left(self.buckets, value)] += 1
+		self.sum += value
+
+class Metrics:
+	"""Counters, gauges and histograms served on METRICS_PORT in the
+	Prometheus text format. Labels are passed as tuples of (name, value)
+	pairs. Gauges are read from a callback whenever metrics are served."""
+
+	def __init__(self):
+		self.types = {}
+		self.counters = collections.defaultdict(collections.Counter)
+		self.histograms = collections.defaultdict(dict)
+		self.gauges = {}
+
+	def count(self, name, labels=(), value=1):
+		self.types.setdefault(name, "counter")
+		self.counters[name][labels] += value
+
+	def observe(self, name, value, labels=(), buckets=METRICS_REQUEST_BUCKETS):
+		self.types.setdefault(name, "histogram")
+		hist = self.histograms[name].get(labels)
+		if hist is None:
+			hist = self.histograms[name][labels] = Histogram(buckets)
+		hist.observe(value)
+
+	def gauge(self, name, fun, kind="gauge"):
+		# fun returns {labels: value}
+		self.types[name] = kind
+		self.gauges[name] = fun
+
+	@staticmethod
+	def _label_value(value):
+		return str(value).replace("\\", "\\\\").replace("\"", "\\\"").replace("\n", "\\n")
+
+	@staticmethod
+	def _labels(labels):
+		if not labels:
+			return ""
+		return "{" + ",".join(['{}="{}"'.format(k, Metrics._label_value(v)) for k, v in labels]) + "}"
+
+	def render(self):
+		lines = []
+		for name, kind in sorted(self.types.items()):
+			lines.append("# TYPE {} {}".format(name, kind))
+			if name in self.gauges:
+				for labels, value in sorted(self.gauges[name]().items()):
+					lines.append("{}{} {}".format(name, self._labels(labels), value))
+			for labels, value in sorted(self.counters[name].items()):
+				lines.append("{}{} {}".format(name, self._labels(labels), value))
+			for labels, hist in sorted(self.histograms[name].items()):
+				total = 0
+				for le, count in zip(hist.buckets + ["+Inf"], hist.counts):
+					total += count
+					lines.append("{}_bucket{} {}".format(name, self._labels(labels + (("le", le),)), total))
+				lines.append("{}_sum{} {}".format(name, self._labels(labels), hist.sum))
+				lines.append("{}_count{} {}".format(name, self._labels(labels), total))
+		return "\n".join(lines) + "\n"
+
+class BackendProfile:
+	"""Aggregates the PERQ timing reports of backends built with OC_PROFILE.
+
+	Each report covers one request: time spent in the request as a whole,
+	time blocked reading from/writing to us, and per command the number of
+	calls, their total time and how much of that was blocked on us."""
+
+	HEADER_FORMAT = ">QQQLL"
+	ENTRY_FORMAT = ">QQL12s"
+
+	def __init__(self):
+		self.reset()
+
+	def reset(self):
+		self.requests = 0
+		self.run_time = 0.0
+		self.read_time = 0.0
+		self.write_time = 0.0
+		self.commands = {}
+
+	def record(self, data):
+		header_size = struct.calcsize(self.HEADER_FORMAT)
+		entry_size = struct.calcsize(self.ENTRY_FORMAT)
+		if len(data) < header_size:
+			return False
+		run_ticks, read_ticks, write_ticks, ticks_per_second, count = struct.unpack_from(self.HEADER_FORMAT, data, 0x0)
+		if not ticks_per_second or len(data) != header_size + count * entry_size:
+			return False
+
+		self.requests += 1
+		self.run_time += run_ticks / ticks_per_second
+		self.read_time += read_ticks / ticks_per_second
+		self.write_time += write_ticks / ticks_per_second
+		for i in range(count):
+			ticks, host_ticks, calls, name = struct.unpack_from(self.ENTRY_FORMAT, data, header_size + i * entry_size)
+			name = name.rstrip(b"\x00").decode(errors="replace")
+			entry = self.commands.setdefault(name, [0, 0.0, 0.0])
+			entry[0] += calls
+			entry[1] += ticks / ticks_per_second
+			entry[2] += host_ticks / ticks_per_second
+		return True
+
+	def stats(self):
+		if not self.requests:
+			return []
+		lines = ["requests {}, run {:.0f}us/req, blocked on read {:.0f}us/req, write {:.0f}us/req".format(
+			self.requests,
+			self.run_time * 1e6 / self.requests,
+			self.read_time * 1e6 / self.requests,
+			self.write_time * 1e6 / self.requests
+		)]
+		for name, (calls, total, host) in sorted(self.commands.items(), key=lambda e: -e[1][1]):
+			lines.append("{}: calls {}, total {:.1f}ms, {:.1f}us/call, {:.1f}us/call blocked on host".format(
+				name,
+				calls,
+				total * 1e3,
+				total * 1e6 / calls,
+				host * 1e6 / calls
+			))
+		return lines
+
 class OrcanoFrontend:
 	async def handle_cleanup(self):
+		print("Indexing data directory...")
+		indexed_count = await self.store.load_index()
+		print("Indexed {} data files.".format(indexed_count))
+
 		while True:
 			# Work before sleep so we do it at startup
-			print("Beginning periodic data cleanup...")
-			scan_time = datetime.datetime.now(datetime.timezone.utc)
-			total_count = 0
+			scan_time = time.monotonic()
+			names, bucket_count = self.store.take_expired(DATA_CLEANUP_EXPIRY_TIME)
+
+			# Delete, serialized with any pending writes
 			deleted_count = 0
+			kept_count = 0
 			error_count = 0
-			files = []
-			with os.scandir(DATA_DIR) as it:
-				for de in it:
-					# Give other stuff a chance to run since we might have to
-					# process a large amount of files
-					await asyncio.sleep(0)
-
-					# Skip irrelevant stuff
-					if not de.is_file():
-						continue
-					if de.name.startswith("."):
-						continue
-
-					total_count += 1
-
-					de_stat = de.stat()
-					de_mtime = datetime.datetime.fromtimestamp(de_stat.st_mtime, tz=datetime.timezone.utc)
-					if scan_time - de_mtime >= datetime.timedelta(seconds=DATA_CLEANUP_EXPIRY_TIME):
-						# Delete
-						try:
-							# print("Deleting {} (mtime={}, stime={})".format(de.path, de_mtime, scan_time))
-							os.remove(de.path)
+			if names:
+				try:
+					expired = await self.store.expire(names, DATA_CLEANUP_EXPIRY_TIME)
+					for name in names:
+						if name not in expired:
+							continue
+						if expired[name] is None:
 							deleted_count += 1
-						except OSError:
-							print("Data cleanup failed to delete {}, traceback:".format(de.path))
-							traceback.print_exc()
-							error_count += 1
-
-			end_time = datetime.datetime.now(datetime.timezone.utc)
-			print("Data cleanup finished in {:.3f} seconds.".format((end_time - scan_time).total_seconds()))
-			print("Data cleanup stats: total {}, deleted {}, errors {}, remaining {}".format(
-				total_count,
-				deleted_count,
-				error_count,
-				total_count - deleted_count
-			))
+						else:
+							kept_count += 1
+				except Exception:
+					error_count = len(names)
+
+			end_time = time.monotonic()
+			self.metrics.count("orcano_cleanup_runs_total")
+			self.metrics.count("orcano_cleanup_files_total", (("result", "expired"),), len(names))
+			self.metrics.count("orcano_cleanup_files_total", (("result", "deleted"),), deleted_count)
+			self.metrics.count("orcano_cleanup_files_total", (("result", "kept"),), kept_count)
+			self.metrics.count("orcano_cleanup_files_total", (("result", "error"),), error_count)
+			self.metrics.count("orcano_cleanup_seconds_total", (), end_time - scan_time)
+			if bucket_count:
+				print("Data cleanup finished in {:.3f} seconds.".format(end_time - scan_time))
+				print("Data cleanup stats: buckets {}, expired {}, deleted {}, kept {}, errors {}, remaining {}".format(
+					bucket_count,
+					len(names),
+					deleted_count,
+					kept_count,
+					error_count,
+					len(self.store.expiry_index)
+				))
+				print("Data cache stats: {}".format(self.store.stats()))
 
 			# Wait for next cycle
 			await asyncio.sleep(DATA_CLEANUP_CYCLE_TIME)
 
 	async def handle_workers(self):
-		workers = []
+		workers = {}
 		while True:
-			while len(workers) < WORKER_COUNT:
-				workers.append(asyncio.create_task(self.handle_dolphin()))
-			done, pending = await asyncio.wait(workers, return_when=asyncio.FIRST_COMPLETED)
-			for d in done: # Trigger exceptions
-				try:
+			for worker_id in range(WORKER_COUNT):
+				if worker_id not in workers:
+					workers[worker_id] = asyncio.create_task(self.handle_dolphin(worker_id))
+			done, pending = await asyncio.wait(workers.values(), return_when=asyncio.FIRST_COMPLETED)
+			for worker_id, d in list(workers.items()):
+				if d not in done:
+					continue
+				del workers[worker_id]
+				self.worker_inflight[worker_id] = 0
+				self.worker_capacity[worker_id] = 0
+				try: # Trigger exceptions
 					await d
 				except:
 					traceback.print_exc()
 			print("Workers: {} died".format(len(done)))
-			workers = list(pending)
+			self.metrics.count("orcano_worker_deaths_total", (), len(done))
 
 	async def start_dolphin(self):
 		inst = {}
@@ -158,39 +1320,136 @@ class OrcanoFrontend:
 		if rdy_msg != b"RDYQ\x00\x00\x00\x00":
 			raise ConnectionRefusedError
 
-		print("Dolphin ready, port={}, pid={}".format(inst["dol_port"], inst["dol_proc"].pid))
+		# Ask for the protocol version. v2 adds request ids and flags to the
+		# header, images that only speak v1 ignore the question.
+		inst["proto"] = 1
+		inst["max_inflight"] = 1
+		inst["dol_tx"].write(b"VERQ" + struct.pack(">LL", 4, DOL_PROTOCOL_VERSION))
+		await inst["dol_tx"].drain()
+		try:
+			ver_header = await asyncio.wait_for(inst["dol_rx"].readexactly(4 + 4), DOL_VERSION_TIME)
+			ver_size = struct.unpack(">L", ver_header[4:8])[0]
+			if ver_header[0:4] != b"VERA" or ver_size not in [4, 8]:
+				raise ConnectionRefusedError
+			# Version, then how many requests the image runs at once
+			ver_data = await asyncio.wait_for(inst["dol_rx"].readexactly(ver_size), DOL_VERSION_TIME)
+			inst["proto"] = min(DOL_PROTOCOL_VERSION, struct.unpack_from(">L", ver_data, 0)[0])
+			if inst["proto"] >= 2 and ver_size >= 8:
+				inst["max_inflight"] = max(1, min(DOL_MAX_INFLIGHT, struct.unpack_from(">L", ver_data, 4)[0]))
+		except asyncio.TimeoutError:
+			pass
+
+		print("Dolphin ready, port={}, pid={}, protocol={}, max_inflight={}".format(
+			inst["dol_port"], inst["dol_proc"].pid, inst["proto"], inst["max_inflight"]))
 
 		return inst
 
 	async def stop_dolphin(self, inst):
 		# Clean up process
 		print("Stopping Dolphin...")
-		inst["dol_proc"].kill()
+		try:
+			inst["dol_proc"].kill()
+		except ProcessLookupError:
+			# Died on its own
+			pass
 		await inst["dol_proc"].wait()
 
 		inst["dol_tx"].close()
 		# Waiting apparently can throw ConnectionResetError if the connection is remotely terminated
 		# await inst["dol_tx"].wait_closed()
 
-	async def handle_dolphin(self):
-		# Start Dolphin
-		inst = await self.start_dolphin()
-
-		async def dol_write_msg(ident, data):
-			msg_buffer = bytearray(4 + 4 + len(data))
-			msg_buffer[0:4] = ident
-			msg_buffer[4:8] = struct.pack(">L", len(data))
-			msg_buffer[8:] = data
+	async def handle_dolphin(self, worker_id):
+		class DolphinCommunicationError(Exception): pass
+		class DolphinReportedError(DolphinCommunicationError): pass
+
+		# Current instance, replaced on restart
+		worker = {}
+
+		async def dol_start():
+			inst = await self.start_dolphin()
+			inst["requests"] = {}
+			inst["last_id"] = None
+			inst["reader"] = asyncio.create_task(dol_reader(inst))
+			worker["inst"] = inst
+			return inst
+
+		def dol_fail(inst, ex):
+			# Every request in flight gets the error on its next read
+			inst["error"] = ex
+			for req in inst["requests"].values():
+				req["queue"].put_nowait(ex)
+
+		async def dol_reader(inst):
+			# Hands messages to the request they belong to
+			try:
+				while True:
+					msg_header = await inst["dol_rx"].readexactly(4 + 4)
+					ident = msg_header[0:4]
+					size = struct.unpack(">L", msg_header[4:8])[0]
+					if size & DOL_MSG_V2:
+						size &= ~DOL_MSG_V2
+						request_id, flags = struct.unpack(">LL", await inst["dol_rx"].readexactly(8))
+						if request_id not in inst["requests"]:
+							raise DolphinCommunicationError("{} for request {}, which is not in flight".format(ident, request_id))
+						inst["last_id"] = request_id
+					else:
+						# SIC: v1 headers are still taken as part of the request
+						# of the last message, so an INSQ with a bad size can
+						# still forge messages.
+						request_id = inst["last_id"]
+					data = await inst["dol_rx"].readexactly(size)
+					log_debug("Recv msg: {}".format(msg_header + data))
+
+					req = inst["requests"].get(request_id)
+					if req is None:
+						raise DolphinCommunicationError("{} outside of a request".format(ident))
+					self.metrics.count("orcano_host_messages_total", (("direction", "rx"), ("ident", msg_ident_label(ident))))
+					req["queue"].put_nowait((ident, data))
+			except (asyncio.IncompleteReadError, ConnectionError, DolphinCommunicationError) as ex:
+				dol_fail(inst, ex)
+
+		async def dol_restart(inst):
+			# Once per instance, no matter how many requests failed with it
+			if "restart" not in inst:
+				async def restart():
+					dol_fail(inst, DolphinCommunicationError("restarting"))
+					inst["reader"].cancel()
+					await self.stop_dolphin(inst)
+					print("Shutdown complete, starting...")
+					new_inst = await dol_start()
+					print("Restart complete.")
+					return new_inst
+				inst["restart"] = asyncio.create_task(restart())
+			return await asyncio.shield(inst["restart"])
+
+		async def dol_write_msg(req, ident, data, flags=0):
+			inst = req["inst"]
+			if inst["proto"] >= 2:
+				msg_buffer = bytearray(4 + 12 + len(data))
+				msg_buffer[0:4] = ident
+				msg_buffer[4:16] = struct.pack(">LLL", len(data) | DOL_MSG_V2, req["id"], flags)
+				msg_buffer[16:] = data
+			else:
+				msg_buffer = bytearray(4 + 4 + len(data))
+				msg_buffer[0:4] = ident
+				msg_buffer[4:8] = struct.pack(">L", len(data))
+				msg_buffer[8:] = data
 			log_debug("Send msg: {}".format(msg_buffer))
+			self.metrics.count("orcano_host_messages_total", (("direction", "tx"), ("ident", msg_ident_label(ident))))
 			inst["dol_tx"].write(msg_buffer)
 			await inst["dol_tx"].drain()
-
-		async def dol_read_msg():
-			msg_header = await inst["dol_rx"].readexactly(4 + 4)
-			ident = msg_header[0:4]
-			size = struct.unpack(">L", msg_header[4:8])[0]
-			data = await inst["dol_rx"].readexactly(size)
-			log_debug("Recv msg: {}".format(msg_header + data))
+			if req["trace"]:
+				req["trace"].on_send(ident.decode(errors="replace"), len(data))
+
+		async def dol_read_msg(req):
+			if req["trace"]:
+				req["trace"].on_wait()
+			msg = await req["queue"].get()
+			if isinstance(msg, Exception):
+				raise msg
+			ident, data = msg
+			if req["trace"]:
+				req["trace"].on_recv(ident.decode(errors="replace"), len(data))
 			return ident, data
 
 		async def dol_timeout(coro):
@@ -198,26 +1457,23 @@ class OrcanoFrontend:
 			#return await asyncio.wait_for(coro, DOL_TIMEOUT)
 			return await coro
 
-		class DolphinCommunicationError(Exception): pass
+		async def process_request(req, task, persistent):
+			# Writes to wait for before answering
+			commits = task["commits"]
 
-		async def process_request(task, persistent):
 			otp = persistent.get("otp", {
 				"uid": None,
 				"storage": b"",
 				"offset": 0,
 			})
 
-			def otp_acquire(uid):
+			async def otp_acquire(uid):
 				if uid == otp["uid"]:
 					return
 
-				otp_path = os.path.join(DATA_DIR, "otp_{:016x}".format(uid))
-
-				# New OTP user. Acquire some secret material.
-				try:
-					with open(otp_path, "rb") as f:
-						otp_secret = bytearray(f.read())
-				except FileNotFoundError:
+				# New OTP user. Acquire some codes.
+				lease = await self.otp.lease(uid, OTP_LEASE_CODES, commits)
+				if lease is None:
 					# OTP not enabled for this account
 					otp_authenticated = False
 					otp["uid"] = None
@@ -226,15 +1482,7 @@ class OrcanoFrontend:
 
 				otp_authenticated = False
 				otp["uid"] = uid
-				otp["offset"] = struct.unpack_from(">L", otp_secret, 0x0)[0]
-				gen = ChaCha20.new(key=otp_secret[0x4:0x24], nonce=otp_secret[0x24:0x2c])
-				gen.seek(otp["offset"] * 8)
-				otp_storage_size = 32
-				otp["storage"] = gen.encrypt(b"\x00" * otp_storage_size)
-				struct.pack_into(">L", otp_secret, 0x0, otp["offset"] + (otp_storage_size // 8))
-
-				with open(otp_path, "wb") as f:
-					f.write(otp_secret)
+				otp["offset"], otp["storage"] = lease
 			def otp_get_code():
 				if not otp["storage"]:
 					# Not authenticated or out of codes
@@ -246,16 +1494,9 @@ class OrcanoFrontend:
 					return
 				otp["storage"] = otp["storage"][8:]
 				otp["offset"] += 1
-			def missing_otp_auth(uid):
-				try:
-					with open(os.path.join(DATA_DIR, "otp_{:016x}".format(uid))) as f:
-						pass
-					user_has_otp = True
-				except FileNotFoundError:
-					user_has_otp = False
-
+			async def missing_otp_auth(uid):
 				# OTP enabled?
-				if not user_has_otp:
+				if not await self.store.exists(otp_file_name(uid)):
 					return False
 
 				# OTP is enabled, authenticated?
@@ -264,12 +1505,15 @@ class OrcanoFrontend:
 
 				return True
 			# Send the initial request
-			await dol_timeout(dol_write_msg(b"REQQ", task["data"]))
+			if req["inst"]["proto"] < 2:
+				# No ids to go by, replies belong to whatever was sent last.
+				req["inst"]["last_id"] = req["id"]
+			await dol_timeout(dol_write_msg(req, b"REQQ", task["data"]))
 
 			# Respond to queries
 			result = bytearray()
 			while True:
-				ident, data = await dol_timeout(dol_read_msg())
+				ident, data = await dol_timeout(dol_read_msg(req))
 				if ident == b"REQA":
 					result += data
 					result += b"\n"
@@ -281,27 +1525,21 @@ class OrcanoFrontend:
 					uid = struct.unpack_from(">Q", data, 0x0)[0]
 					idx = struct.unpack_from(">L", data, 0x8)[0]
 
-					if missing_otp_auth(uid):
-						await dol_timeout(dol_write_msg(b"GTNA", b"\x00" * 8))
+					if await missing_otp_auth(uid):
+						await dol_timeout(dol_write_msg(req, b"GTNA", b"\x00" * 8))
 						continue
 
 					# TODO: Should we check that this user exists here?
-					num_path = os.path.join(DATA_DIR, "num_{:016x}_{:08x}".format(uid, idx))
-					num_data = None
-					try:
-						with open(num_path, "rb") as f:
-							num_data = f.read()
-						if len(num_data) != 8:
-							print("Invalid number data read from disk for uid={:016x}, idx={:08x}".format(uid, idx))
-							num_data = None
-					except FileNotFoundError:
+					num_data = await self.store.read(num_file_name(uid, idx))
+					if num_data is not None and len(num_data) != 8:
+						print("Invalid number data read from disk for uid={:016x}, idx={:08x}".format(uid, idx))
 						num_data = None
 
 					# Provide default
 					if num_data == None:
 						num_data = b"\x00" * 8
 
-					await dol_timeout(dol_write_msg(b"GTNA", num_data))
+					await dol_timeout(dol_write_msg(req, b"GTNA", num_data))
 				elif ident == b"STNQ":
 					if len(data) != 0x14:
 						raise DolphinCommunicationError("invalid setn query len 0x{:x}".format(len(data)))
@@ -317,22 +1555,12 @@ class OrcanoFrontend:
 					if uid == 0 and (idx == 0x20000000 or idx == 0x20000001):
 						continue
 
-					if missing_otp_auth(uid):
+					if await missing_otp_auth(uid):
 						continue
 
 					# Check for lock
-					lock_path = os.path.join(DATA_DIR, "lock_{:016x}_{:08x}".format(uid, idx))
-					try:
-						with open(lock_path, "rb") as f:
-							locked = True
-					except FileNotFoundError:
-						locked = False
-
-					# TODO: This shares code with GTNQ, maybe we can extract it.
-					if not locked:
-						num_path = os.path.join(DATA_DIR, "num_{:016x}_{:08x}".format(uid, idx))
-						with open(num_path, "wb") as f:
-							f.write(num_data)
+					if not await self.store.exists(lock_file_name(uid, idx)):
+						commits.append(self.store.write(num_file_name(uid, idx), num_data))
 				elif ident == b"LKNQ":
 					if len(data) != 0xc:
 						raise DolphinCommunicationError("invalid lockn query len 0x{:x}".format(len(data)))
@@ -344,15 +1572,11 @@ class OrcanoFrontend:
 					if uid == 0:
 						continue
 
-					if missing_otp_auth(uid):
+					if await missing_otp_auth(uid):
 						continue
 
-					# TODO: This shares code with STNQ
-					lock_path = os.path.join(DATA_DIR, "lock_{:016x}_{:08x}".format(uid, idx))
-
 					# Create the lock file if it didn't exist already
-					with open(lock_path, "wb") as f:
-						pass
+					commits.append(self.store.write(lock_file_name(uid, idx), b""))
 				elif ident == b"INSQ":
 					if len(data) < 4:
 						raise DolphinCommunicationError("invalid inspect query len 0x{:x}".format(len(data)))
@@ -377,22 +1601,11 @@ class OrcanoFrontend:
 					if uid == 0:
 						protected_user = True
 
-					def check_file_exists(path):
-						try:
-							with open(path, "rb") as f:
-								pass
-							exists = True
-						except FileNotFoundError:
-							exists = False
-						return exists
-
 					# Check for existing OTP or user registration
-					otp_path = os.path.join(DATA_DIR, "otp_{:016x}".format(uid))
-					key0_path = os.path.join(DATA_DIR, "num_{:016x}_20000000".format(uid))
-					key1_path = os.path.join(DATA_DIR, "num_{:016x}_20000001".format(uid))
-					otp_exists = check_file_exists(otp_path)
-					key0_exists = check_file_exists(key0_path)
-					key1_exists = check_file_exists(key1_path)
+					otp_name = otp_file_name(uid)
+					otp_exists = await self.store.exists(otp_name)
+					key0_exists = await self.store.exists(num_file_name(uid, 0x20000000))
+					key1_exists = await self.store.exists(num_file_name(uid, 0x20000001))
 
 					if protected_user or otp_exists or key0_exists or key1_exists:
 						# User already exists, refuse enabling OTP
@@ -402,11 +1615,11 @@ class OrcanoFrontend:
 						cc_key = secrets.token_bytes(32)
 						cc_nonce = secrets.token_bytes(8)
 						otp_data = b"\x00\x00\x00\x00" + cc_key + cc_nonce
-						with open(otp_path, "wb") as f:
-							f.write(otp_data)
+						self.otp.forget(uid)
+						commits.append(self.store.write(otp_name, otp_data))
 						# Send response
 						resp_data = b"\x00\x00\x00\x01" + cc_key + cc_nonce
-					await dol_timeout(dol_write_msg(b"OTIA", resp_data))
+					await dol_timeout(dol_write_msg(req, b"OTIA", resp_data))
 				elif ident == b"OTAQ":
 					# Auth OTP
 					if len(data) != 0x10:
@@ -414,21 +1627,21 @@ class OrcanoFrontend:
 					uid = struct.unpack_from(">Q", data, 0x0)[0]
 					code = struct.unpack_from(">Q", data, 0x8)[0]
 
-					otp_acquire(uid)
+					await otp_acquire(uid)
 					expected_code = otp_get_code()
 					if expected_code != code:
 						resp_data = b"\x00\x00\x00\x00"
 					else:
 						otp_authenticated = True
 						resp_data = b"\x00\x00\x00\x01"
-					await dol_timeout(dol_write_msg(b"OTAA", resp_data))
+					await dol_timeout(dol_write_msg(req, b"OTAA", resp_data))
 				elif ident == b"OTGQ":
 					# Get OTP
 					if len(data) != 8:
 						raise DolphinCommunicationError("invalid otp get query len 0x{:x}".format(len(data)))
 					uid = struct.unpack_from(">Q", data, 0x0)[0]
 
-					otp_acquire(uid)
+					await otp_acquire(uid)
 					next_code = otp_get_code()
 					if next_code != None:
 						next_offset = otp["offset"]
@@ -439,7 +1652,7 @@ class OrcanoFrontend:
 					resp_data = bytearray(0xc)
 					struct.pack_into(">L", resp_data, 0x0, next_offset)
 					struct.pack_into(">Q", resp_data, 0x4, next_code)
-					await dol_timeout(dol_write_msg(b"OTGA", resp_data))
+					await dol_timeout(dol_write_msg(req, b"OTGA", resp_data))
 				elif ident == b"OTNQ":
 					# Next OTP
 					if len(data) != 0:
@@ -449,11 +1662,14 @@ class OrcanoFrontend:
 					result += b"print: "
 					result += bytes(filter(lambda c: c in string.printable.encode(), data))
 					result += b"\n"
+				elif ident == b"PERQ":
+					if not self.profile.record(data):
+						raise DolphinCommunicationError("invalid profile len 0x{:x}".format(len(data)))
 				elif ident == b"LOGQ":
 					print("DOL log: {}".format(data))
 				elif ident == b"ERRQ":
 					print("DOL reported error: {}".format(data))
-					raise DolphinCommunicationError()
+					raise DolphinReportedError()
 				else:
 					print("DOL bad msg: ident={} data={}".format(ident, data))
 					raise DolphinCommunicationError()
@@ -462,45 +1678,212 @@ class OrcanoFrontend:
 			persistent["otp"] = otp
 			return result
 
-		# Serve requests
-		while True:
-			task, persistent = await self.request_queue.get()
-
+		async def serve(inst, task, persistent):
 			request_start = datetime.datetime.utcnow()
+			self.worker_inflight[worker_id] += 1
+			self.metrics.observe("orcano_queue_wait_seconds", time.monotonic() - task["submit_time"], (("client", task["client_class"]),))
+			trace = task["trace"]
+			if trace:
+				trace.worker_id = worker_id
+				trace.span("queue", trace.start)
+				process_start = trace.tracer.now()
+
+			# Random ids, so the INSQ forgery (see dol_reader) can't guess
+			# its way into another request in flight on the same instance
+			request_id = secrets.randbits(32)
+			while request_id in inst["requests"]:
+				request_id = secrets.randbits(32)
+			req = {
+				"id": request_id,
+				"inst": inst,
+				"queue": asyncio.Queue(),
+				"trace": trace,
+			}
+			inst["requests"][req["id"]] = req
+			if "error" in inst:
+				req["queue"].put_nowait(inst["error"])
+
 			print("Serving request to Dolphin on port {}: {}".format(inst["dol_port"], bytes(task["data"])))
 			try:
-				result = await asyncio.wait_for(process_request(task, persistent), MAX_REQUEST_TIME)
-			except (asyncio.IncompleteReadError, asyncio.TimeoutError, DolphinCommunicationError) as ex:
-				# Dolphin died or timed out
-				print("Request execution failed, traceback:")
-				traceback.print_exc()
+				result = await asyncio.wait_for(process_request(req, task, persistent), MAX_REQUEST_TIME)
+				task["complete"] = True
+				self.costs.learn(task["cost_features"], (datetime.datetime.utcnow() - request_start).total_seconds())
+				if trace:
+					trace.span("process", process_start)
+			except (asyncio.IncompleteReadError, asyncio.TimeoutError, ConnectionError, DolphinCommunicationError) as ex:
+				if isinstance(ex, asyncio.TimeoutError):
+					cause = "timeout"
+				elif isinstance(ex, asyncio.IncompleteReadError):
+					cause = "incomplete_read"
+				elif isinstance(ex, ConnectionError):
+					cause = "connection"
+				elif isinstance(ex, DolphinReportedError):
+					cause = "errq"
+				else:
+					cause = "protocol"
+
+				# Dolphin died or timed out. Other requests in flight fail
+				# along with this one, only the first one counts.
+				if "restart" not in inst:
+					print("Request execution failed, traceback:")
+					traceback.print_exc()
+					self.metrics.count("orcano_dolphin_restarts_total", (("cause", cause),))
+				if trace:
+					trace.span("process", process_start, args={"error": cause})
+					restart_start = trace.tracer.now()
 
 				# Restart Dolphin
-				await self.stop_dolphin(inst)
-				print("Shutdown complete, starting...")
-				inst = await self.start_dolphin()
-				print("Restart complete.")
+				await dol_restart(inst)
+				if trace:
+					trace.span("restart", restart_start)
 
 				# Fail the request
 				if isinstance(ex, asyncio.TimeoutError):
 					result = b"error: timeout\n"
 				else:
 					result = b"error: internal\n"
+			finally:
+				del inst["requests"][req["id"]]
 
 			# For performance estimation
 			# TODO: Should probably get rid of this overhead for final
 			request_end = datetime.datetime.utcnow()
 			request_duration = request_end - request_start
 			print("Request took {}us: {}".format(request_duration / datetime.timedelta(microseconds=1), bytes(result)))
-
-			# Return the result
-			task["result_fut"].set_result(result)
+			self.worker_inflight[worker_id] -= 1
+			self.metrics.observe("orcano_request_service_seconds", request_duration.total_seconds())
+
+			# Return the result once everything it wrote is on disk. The
+			# worker doesn't wait for that so it can serve the next request.
+			if task["commits"]:
+				asyncio.create_task(imm_error(self.finish_request(task, result)))
+			else:
+				task["result_fut"].set_result(result)
 			self.request_queue.task_done()
 
+		# Start Dolphin
+		await dol_start()
+		self.worker_inflight[worker_id] = 0
+
+		# Serve requests, as many at once as the image takes
+		serving = {}
+		next_request = None
+		try:
+			while True:
+				for d in [d for d in serving if d.done()]:
+					del serving[d]
+					d.result() # Trigger exceptions
+
+				inst = worker["inst"]
+				self.worker_capacity[worker_id] = inst["max_inflight"]
+				if "restart" in inst:
+					await asyncio.shield(inst["restart"])
+					continue
+				if len(serving) >= inst["max_inflight"]:
+					await asyncio.wait(serving, return_when=asyncio.FIRST_COMPLETED)
+					continue
+
+				if next_request is None:
+					next_request = asyncio.create_task(self.request_queue.get())
+				await asyncio.wait([*serving, next_request], return_when=asyncio.FIRST_COMPLETED)
+				if not next_request.done():
+					continue
+				task, persistent = next_request.result()
+				next_request = None
+
+				# Dolphin might have failed while we waited
+				inst = worker["inst"]
+				while "restart" in inst:
+					inst = await asyncio.shield(inst["restart"])
+
+				# The client will have given up on it before it's done, restarts
+				# take long. This is the last chance: once sent, a request runs
+				# to the end and is answered, since it may write data and the
+				# client only sends its next request after the answer.
+				if time.monotonic() + task["cost"] >= task["deadline"]:
+					self.metrics.count("orcano_requests_shed_total", (("reason", "expired"),))
+					task["result_fut"].set_result(b"error: busy\n")
+					self.request_queue.task_done()
+					continue
+				serving[asyncio.create_task(serve(inst, task, persistent))] = task
+		finally:
+			# Don't leave anyone waiting on a dead worker
+			if next_request:
+				next_request.cancel()
+				if next_request.done() and not next_request.cancelled():
+					serving[next_request] = next_request.result()[0]
+			for d, task in serving.items():
+				d.cancel()
+				if not task["result_fut"].done():
+					task["result_fut"].set_result(b"error: internal\n")
+
+	def queue_wait(self):
+		"""How long a request would wait for a worker if it came in now,
+		going by the expected cost of what is queued."""
+		capacity = sum(self.worker_capacity.values())
+		if not capacity:
+			# Nothing to go by while Dolphin starts
+			return 0.0
+		return self.request_queue.cost / capacity
+
+	async def finish_request(self, task, result):
+		commit_start = self.tracer.now()
+		try:
+			await asyncio.gather(*task["commits"])
+		except Exception:
+			result = b"error: internal\n"
+		if task["trace"]:
+			task["trace"].span("commit", commit_start, args={"writes": len(task["commits"])})
+		task["result_fut"].set_result(result)
+
+	async def handle_loop_monitor(self):
+		# Measures how late the event loop wakes us up, which is how long
+		# something else held it.
+		loop = asyncio.get_running_loop()
+		samples = []
+		report_time = loop.time() + LOOP_MONITOR_REPORT_TIME
+		while True:
+			start = loop.time()
+			await asyncio.sleep(LOOP_MONITOR_INTERVAL)
+			now = loop.time()
+			samples.append(now - start - LOOP_MONITOR_INTERVAL)
+
+			if now >= report_time:
+				samples.sort()
+				def pct(p):
+					return samples[min(len(samples) - 1, int(len(samples) * p))] * 1e6
+				print("Event loop lag: samples {}, p50 {:.0f}us, p99 {:.0f}us, max {:.0f}us".format(
+					len(samples),
+					pct(0.5),
+					pct(0.99),
+					samples[-1] * 1e6
+				))
+				print("Data store stats: {}".format(self.store.stats()))
+				print("Result cache stats: {}".format(self.results.stats()))
+				for line in self.profile.stats():
+					print("Backend profile: {}".format(line))
+				self.profile.reset()
+				samples = []
+				report_time = now + LOOP_MONITOR_REPORT_TIME
+
 	async def handle_connection(self, client_rx, client_tx):
 		client_tx.write(b"Hey! Listen!\n")
 		await client_tx.drain()
 
+		# Requests from one address share a limit, however many connections
+		# they come in on. Clients behind NAT share it too, so it's optional.
+		peer = client_tx.get_extra_info("peername")
+		address = peer[0] if peer else "unknown"
+		client = self.clients.get(address)
+		if client is None:
+			client = self.clients[address] = {
+				"connections": 0,
+				"slots": asyncio.Semaphore(CLIENT_MAX_INFLIGHT) if CLIENT_MAX_INFLIGHT else None,
+			}
+		client["connections"] += 1
+		self.connection_count += 1
+		connection = self.connection_count
+
 		# TODO: Network timeouts?
 		persistent = {}
 		try:
@@ -521,34 +1904,166 @@ class OrcanoFrontend:
 				if not task_data:
 					break
 
+				# Repeats of pure requests don't need Dolphin
+				pure = ResultCache.is_pure(task_data)
+				if pure:
+					result = self.results.lookup(task_data)
+					if result is not None:
+						# Kept out of orcano_request_seconds, which is about
+						# the requests that had to wait
+						self.metrics.count("orcano_requests_unqueued_total", (("reason", "cache"),))
+						client_tx.write(result)
+						continue
+				else:
+					self.results.impure += 1
+
+				# Neither do requests that fail on syntax
+				if REQUEST_PREVALIDATE:
+					error = RequestValidator.check(task_data)
+					if error is not None:
+						self.metrics.count("orcano_requests_unqueued_total", (("reason", "prevalidated"),))
+						client_tx.write(b"error: " + error + b"\n")
+						continue
+
 				# Assemble request
 				task_result_fut = asyncio.Future()
+				self.request_count += 1
+				cost_features = CostModel.features(task_data)
+				submit_time = time.monotonic()
 				task = {
 					"data": task_data,
-					"result_fut": task_result_fut
+					"result_fut": task_result_fut,
+					"commits": [],
+					"trace": self.tracer.begin(self.request_count, task_data),
+					"complete": False,
+					"cost_features": cost_features,
+					# Nothing runs longer than that anyway
+					"cost": min(self.costs.predict(cost_features), MAX_REQUEST_TIME),
+					"submit_time": submit_time,
+					"deadline": submit_time + REQUEST_DEADLINE,
+					"client": address,
+					"connection": connection,
+					"client_class": "single" if client["connections"] == 1 else "multi",
 				}
 
-				# Submit for processing
-				await self.request_queue.put((task, persistent))
-
-				# Wait for completion
-				result = await task_result_fut
+				if client["slots"]:
+					await client["slots"].acquire()
+				try:
+					# Turn away what can't be done in time, rather than
+					# keep everyone waiting for it
+					if time.monotonic() + self.queue_wait() + task["cost"] > task["deadline"]:
+						self.metrics.count("orcano_requests_shed_total", (("reason", "admission"),))
+						task_result_fut.set_result(b"error: busy\n")
+					else:
+						# Submit for processing
+						await self.request_queue.put((task, persistent))
+
+					# Wait for completion
+					result = await task_result_fut
+				finally:
+					if client["slots"]:
+						client["slots"].release()
+				self.metrics.observe("orcano_request_seconds", time.monotonic() - submit_time)
+				if task["trace"]:
+					task["trace"].span("request", task["trace"].start, args={
+						"commands": b" ".join(cmd.split(b":")[0] for cmd in task_data.split(b" ")).decode(errors="replace"),
+						"request_len": len(task_data),
+						"result_len": len(result),
+					})
+					self.tracer.finish(task["trace"])
+
+				# Only what the engine answered, failures might go
+				# differently next time.
+				if pure and task["complete"]:
+					self.results.insert(task_data, result)
 
 				# Write back the result
 				client_tx.write(result)
 		except (asyncio.IncompleteReadError, asyncio.TimeoutError):
 			pass
+		finally:
+			client["connections"] -= 1
+			if not client["connections"]:
+				del self.clients[address]
 
 		client_tx.close()
 		await client_tx.wait_closed()
 
+	async def handle_metrics(self, client_rx, client_tx):
+		# Just enough HTTP for curl and Prometheus
+		try:
+			request = await asyncio.wait_for(client_rx.readuntil(b"\r\n\r\n"), 5.0)
+			path = request.split(b" ")[1] if request.count(b" ") >= 2 else b""
+			if path in [b"/", b"/metrics"]:
+				status = b"200 OK"
+				body = self.metrics.render().encode()
+			else:
+				status = b"404 Not Found"
+				body = b"not found\n"
+			client_tx.write(b"HTTP/1.0 " + status + b"\r\n")
+			client_tx.write(b"Content-Type: text/plain; version=0.0.4\r\n")
+			client_tx.write("Content-Length: {}\r\n\r\n".format(len(body)).encode())
+			client_tx.write(body)
+			await client_tx.drain()
+		except (asyncio.IncompleteReadError, asyncio.LimitOverrunError, asyncio.TimeoutError, ConnectionError):
+			pass
+		client_tx.close()
+
+	def setup_metrics(self):
+		self.metrics = Metrics()
+		self.worker_inflight = {}
+		self.worker_capacity = {}
+		self.metrics.gauge("orcano_queue_depth", lambda: {(): self.request_queue.qsize()})
+		self.metrics.gauge("orcano_worker_inflight", lambda: {
+			(("worker", worker_id),): inflight for worker_id, inflight in self.worker_inflight.items()
+		})
+		self.metrics.gauge("orcano_data_cache_entries", lambda: {(): len(self.store.entries)})
+		self.metrics.gauge("orcano_data_indexed_files", lambda: {(): len(self.store.expiry_index)})
+		self.metrics.gauge("orcano_data_cache_lookups_total", lambda: {
+			(("result", "hit"),): self.store.hits,
+			(("result", "miss"),): self.store.misses,
+		}, "counter")
+		self.metrics.gauge("orcano_data_commit_batches_total", lambda: {(): self.store.commit_batches}, "counter")
+		self.metrics.gauge("orcano_clients", lambda: {(): len(self.clients)})
+		self.metrics.gauge("orcano_clients_at_limit", lambda: {
+			(): sum(1 for client in self.clients.values() if client["slots"] and client["slots"].locked())
+		})
+		self.metrics.gauge("orcano_scheduler_clients", lambda: {(): len(self.request_queue.groups)})
+		self.metrics.gauge("orcano_scheduler_connections", lambda: {(): self.request_queue.connections()})
+		self.metrics.gauge("orcano_queue_expected_wait_seconds", lambda: {(): self.queue_wait()})
+		self.metrics.gauge("orcano_scheduler_starved_total", lambda: {(): self.request_queue.starved}, "counter")
+		self.metrics.gauge("orcano_cost_base_seconds", lambda: {(): self.costs.base})
+		self.metrics.gauge("orcano_cost_unit_seconds", lambda: {
+			(("command", name.decode(errors="replace")),): cost for name, cost in self.costs.unit.items()
+		})
+		self.metrics.gauge("orcano_result_cache_entries", lambda: {(): len(self.results.entries)})
+		self.metrics.gauge("orcano_result_cache_bytes", lambda: {(): self.results.bytes})
+		self.metrics.gauge("orcano_result_cache_lookups_total", lambda: {
+			(("result", "hit"),): self.results.hits,
+			(("result", "miss"),): self.results.misses,
+			(("result", "impure"),): self.results.impure,
+		}, "counter")
+
 	async def run(self):
 		self.port_pool = asyncio.Queue()
 		for i in range(55020, 55520):
 			await self.port_pool.put(i)
-		self.request_queue = asyncio.Queue(maxsize=QUEUE_MAX_LEN)
+		self.costs = CostModel()
+		self.request_queue = RequestScheduler(maxsize=QUEUE_MAX_LEN)
+		self.clients = {}
+		self.connection_count = 0
+		self.store = DataStore(DATA_CACHE_MAX_ENTRIES)
+		self.otp = OtpManager(self.store, OTP_CACHE_MAX_USERS)
+		self.profile = BackendProfile()
+		self.results = ResultCache(RESULT_CACHE_MAX_ENTRIES, RESULT_CACHE_MAX_BYTES)
+		self.tracer = Tracer(TRACE_PATH, self.store.executor)
+		self.request_count = 0
+		self.setup_metrics()
+		asyncio.create_task(imm_error(self.store.handle_commits()))
+		asyncio.create_task(imm_error(self.handle_loop_monitor()))
 		asyncio.create_task(imm_error(self.handle_workers()))
 		asyncio.create_task(imm_error(self.handle_cleanup()))
+		await asyncio.start_server(self.handle_metrics, "0.0.0.0", METRICS_PORT)
 		server = await asyncio.start_server(self.handle_connection, "0.0.0.0", SERVICE_PORT)
 		print("Serving requests on {}".format(SERVICE_PORT))
 		await server.serve_forever()
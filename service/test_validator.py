@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+# Checks RequestValidator against the engine itself: every error the
+# frontend answers on its own has to be what the engine would have said.
+#
+# Needs the native engine build, run with
+#   make -C image/native test
+# or point ORCANO_RUN at build/orcano-run from there.
+
+import os
+import sys
+import base64
+import random
+import struct
+import subprocess
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from service import RequestValidator, MAX_REQUEST_SIZE
+
+ORCANO_RUN = os.getenv("ORCANO_RUN", os.path.join(
+	os.path.dirname(os.path.abspath(__file__)), "..", "image", "native", "build", "orcano-run"))
+CORPUS_SEED = 1
+CORPUS_REQUESTS = 3000 # generated, each also goes in mutated
+MIN_CLAIMED = 1000 # the corpus has to exercise the validator at all
+
+COMMANDS = [
+	"int", "float", "dup", "rpt", "del", "drop", "stack",
+	"addi", "addf", "muli", "mulf", "poly", "weight",
+	"user", "getn", "setn", "lockn", "otp_init", "otp_auth", "otp_sync",
+	"vec", "vaddf", "vmulf", "vscale", "vsumf", "vdotf",
+	"sumi", "sumf", "minf", "maxf", "scanf",
+	"inspect", "print", "help", "nope",
+]
+
+# What the validator follows through, so these come up more often
+SIMPLE_COMMANDS = ["int", "float", "dup", "del", "stack", "addi", "addf", "muli", "mulf"]
+
+# Spliced into requests, mostly what changes how they parse
+MUTATIONS = [
+	b"", b" ", b"  ", b":", b"::", b"x", b"\t", b"0x", b"09", b"e", b"=",
+	b"!", b"A", b"==", b"s", b"p", b"i", b"f", b"nan(", b"inf", b"1", b"-",
+	b"\x80",
+]
+
+def make_immediate(rng):
+	r = rng.random()
+	if r < 0.3:
+		return "i{}".format(rng.choice([0, 1, 2, 3, -1, 5, 7, 100, -50, 255, 256, -99999, "0x10", "010", "1e3", "", "+", "0x"]))
+	if r < 0.55:
+		return "f{}".format(rng.choice(["1.5", "-2.25", "0", "1e30", "-0.0", "3", ".5", "1e", "0x1p3", "", "nan", str(rng.uniform(-100, 100))]))
+	if r < 0.7:
+		return rng.choice(["s", "s", "s", "", "x", "s1"])
+	count = rng.choice([1, 2, 3, 5, 32, 33, 40])
+	data = struct.pack(">b", rng.randint(-8, 8))
+	data += b"".join(struct.pack(">h", rng.randint(-32768, 32767)) for i in range(count))
+	if rng.random() < 0.05:
+		data = data[:-1]
+	return "p" + base64.b64encode(data).decode()
+
+def make_command(rng):
+	name = rng.choice(SIMPLE_COMMANDS if rng.random() < 0.6 else COMMANDS)
+	if name == "weight":
+		data = bytes(rng.randrange(256) for i in range(rng.randint(0, 12)))
+		return name + ":" + base64.b64encode(data).decode()
+	if name == "print":
+		return "print:hello"
+	args = [make_immediate(rng) for i in range(rng.choice([0, 0, 1, 1, 2, 3, 4]))]
+	return ":".join([name] + args)
+
+def make_corpus():
+	rng = random.Random(CORPUS_SEED)
+	requests = []
+	for i in range(CORPUS_REQUESTS):
+		# Now and then long enough to fill up the stack
+		count = rng.randint(1, 12) if rng.random() < 0.9 else rng.randint(100, 300)
+		request = " ".join(make_command(rng) for i in range(count)).encode()
+		requests.append(request)
+
+		mutated = bytearray(request)
+		for j in range(rng.randint(1, 3)):
+			pos = rng.randint(0, len(mutated))
+			mutated[pos:pos + rng.randint(0, 2)] = rng.choice(MUTATIONS)
+		requests.append(bytes(mutated))
+
+	# Whatever the frontend passes on: one line, within the size limit
+	return [r for r in requests if r.strip() and b"\n" not in r and b"\r" not in r and len(r.strip()) <= MAX_REQUEST_SIZE]
+
+def run_engine(requests):
+	proc = subprocess.run(
+		[ORCANO_RUN],
+		input=b"".join(r + b"\n" for r in requests),
+		capture_output=True,
+		check=True,
+		timeout=60,
+	)
+	responses = proc.stdout.split(b"\n")[:-1]
+	if len(responses) != len(requests):
+		raise RuntimeError("{} responses for {} requests".format(len(responses), len(requests)))
+	return responses
+
+@unittest.skipUnless(os.path.exists(ORCANO_RUN), "native engine build not found, see image/native")
+class RequestValidatorTest(unittest.TestCase):
+	def test_matches_engine(self):
+		# The frontend strips the line before checking it
+		requests = [r.strip() for r in make_corpus()]
+		claimed = [(r, RequestValidator.check(r)) for r in requests]
+		claimed = [(r, error) for r, error in claimed if error is not None]
+		self.assertGreaterEqual(len(claimed), MIN_CLAIMED)
+
+		responses = run_engine([r for r, error in claimed])
+		for (request, error), response in zip(claimed, responses):
+			with self.subTest(request=request):
+				self.assertEqual(b"error: " + error, response)
+
+if __name__ == "__main__":
+	unittest.main()